@@ -29,38 +29,31 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    // cumulative size of all previous entries
-    size_t cumulative_size = 0;
-    // starting index
-    uint8_t index = buffer->out_offs;
-    size_t num_entries;
-    size_t count;
+    uint64_t offset;
+    uint32_t low = 0;
+    uint32_t high;
+    struct aesd_buffer_entry *entry;
 
     // validate input
-    if (!buffer)
+    if (!buffer || char_offset >= aesd_circular_buffer_size(buffer))
         return NULL;
 
-    // Number of valid entries
-    num_entries = buffer->full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
-                                        ((buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs)
-                                         % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    // binary search for the last entry starting at or before the offset; entry offsets increase from the oldest
+    offset = buffer->start_offset + char_offset;
+    high = aesd_circular_buffer_count(buffer) - 1;
+    while (low < high) {
+        uint32_t mid = low + (high - low + 1) / 2;
 
-    // iterate through entries, summing sizes until char_offset is within an entry
-    for (count = 0; count < num_entries; count++) {
-        size_t entry_size = buffer->entry[index].size;
-
-        if (char_offset < cumulative_size + entry_size) {
-            if (entry_offset_byte_rtn)
-                *entry_offset_byte_rtn = char_offset - cumulative_size;
-            return &buffer->entry[index];
-        }
-
-        cumulative_size += entry_size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (aesd_circular_buffer_entry_at(buffer, mid)->offset <= offset)
+            low = mid;
+        else
+            high = mid - 1;
     }
 
-    // offset beyond available data
-    return NULL;
+    entry = aesd_circular_buffer_entry_at(buffer, low);
+    if (entry_offset_byte_rtn)
+        *entry_offset_byte_rtn = offset - entry->offset;
+    return entry;
 }
 
 
@@ -76,21 +69,90 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     // if buffer is full, advance the out offset to make room
     if (buffer->full) {
         // we are about to overwrite oldest entry
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
     }
 
-    // add the new entry at the in offset
+    // add the new entry at the in offset, after all bytes added so far
     buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->entry[buffer->in_offs].offset = buffer->end_offset;
+    buffer->end_offset += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
+    buffer->start_offset = buffer->entry[buffer->out_offs].offset;
+
+    // set full flag accordingly; the in offset wraps to the out offset when depth uses all the storage
+    buffer->full = ((buffer->in_offs - buffer->out_offs) & buffer->mask) == (buffer->depth & buffer->mask);
+}
+
+/**
+* Removes the oldest entry of @param buffer by advancing buffer->out_offs.
+* Any necessary locking must be handled by the caller
+* @return the removed entry, which stays valid until the next entry is added, or NULL if the buffer is empty
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
 
-    // set full flag accordingly
-    buffer->full = (buffer->in_offs == buffer->out_offs);
+    if (aesd_circular_buffer_count(buffer) == 0)
+        return NULL;
+
+    entry = &buffer->entry[buffer->out_offs];
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->full = false;
+    buffer->start_offset += entry->size;
+    return entry;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct retaining
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its inline storage
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->mask = AESDCHAR_INLINE_CAPACITY - 1;
+    buffer->depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty buffer retaining @param depth entries
+* in @param storage, an array of @param capacity entries owned by the caller. capacity must be a power of two
+* and at least depth.
+*/
+void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *storage,
+            uint32_t capacity, uint32_t depth)
+{
+    buffer->entry = storage;
+    buffer->in_offs = 0;
+    buffer->out_offs = 0;
+    buffer->full = false;
+    buffer->mask = capacity - 1;
+    buffer->depth = depth;
+    buffer->start_offset = 0;
+    buffer->end_offset = 0;
+}
+
+/**
+* Initializes @param dst like aesd_circular_buffer_init_storage and fills it with the newest entries of @param src
+* that fit @param depth, oldest first. Entries of src that don't fit are not copied; releasing the memory they
+* reference is up to the caller. src is not modified and may not share storage with dst.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_copy(struct aesd_circular_buffer *dst, struct aesd_buffer_entry *storage,
+            uint32_t capacity, uint32_t depth, const struct aesd_circular_buffer *src)
+{
+    uint32_t count = aesd_circular_buffer_count(src);
+    uint32_t skip = count > depth ? count - depth : 0;
+    uint32_t first = (src->out_offs + skip) & src->mask;
+    uint32_t num = count - skip;
+    // entries up to the end of the source array, then the wrapped part
+    uint32_t head = num < src->mask + 1 - first ? num : src->mask + 1 - first;
+
+    aesd_circular_buffer_init_storage(dst, storage, capacity, depth);
+    memcpy(storage, &src->entry[first], head * sizeof(*storage));
+    memcpy(storage + head, src->entry, (num - head) * sizeof(*storage));
+    dst->in_offs = num & dst->mask;
+    dst->full = num == depth;
+    dst->end_offset = src->end_offset;
+    dst->start_offset = num ? storage[0].offset : src->end_offset;
 }
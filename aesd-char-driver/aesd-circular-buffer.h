@@ -16,7 +16,14 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Number of entries retained by a buffer set up with aesd_circular_buffer_init
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Size of the storage aesd_circular_buffer_init uses, the next power of two
+ */
+#define AESDCHAR_INLINE_CAPACITY 16
 
 struct aesd_buffer_entry
 {
@@ -28,27 +35,54 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the first byte among all bytes ever added to the buffer, set by
+     * aesd_circular_buffer_add_entry
+     */
+    uint64_t offset;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations,
+     * with mask + 1 elements
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds depth entries
      */
     bool full;
+    /**
+     * Size of the entry array minus one; the size is a power of two, so offsets wrap with a mask
+     */
+    uint32_t mask;
+    /**
+     * Number of entries retained before the oldest is overwritten, at most mask + 1
+     */
+    uint32_t depth;
+    /**
+     * Offset of the oldest entry, or end_offset when empty
+     */
+    uint64_t start_offset;
+    /**
+     * Offset just past the newest entry, the total size of all entries ever added
+     */
+    uint64_t end_offset;
+    /**
+     * Storage used by aesd_circular_buffer_init. Kept last: buffers using other storage may be
+     * allocated without it
+     */
+    struct aesd_buffer_entry inline_entry[AESDCHAR_INLINE_CAPACITY];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,16 +90,49 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *storage,
+            uint32_t capacity, uint32_t depth);
+
+extern void aesd_circular_buffer_copy(struct aesd_circular_buffer *dst, struct aesd_buffer_entry *storage,
+            uint32_t capacity, uint32_t depth, const struct aesd_circular_buffer *src);
+
+/**
+ * @return the number of valid entries in @param buffer
+ */
+static inline uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->full ? buffer->depth : ((buffer->in_offs - buffer->out_offs) & buffer->mask);
+}
+
+/**
+ * @return the number of bytes in the valid entries of @param buffer
+ */
+static inline uint64_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->end_offset - buffer->start_offset;
+}
+
+/**
+ * @return the entry @param n places after the oldest one in @param buffer
+ */
+static inline struct aesd_buffer_entry *aesd_circular_buffer_entry_at(const struct aesd_circular_buffer *buffer,
+            uint32_t n)
+{
+    return &buffer->entry[(buffer->out_offs + n) & buffer->mask];
+}
+
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * Create a for loop to iterate over each valid member of the circular buffer, oldest first.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -73,9 +140,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[index]))
+    for(index=0, entryptr=aesd_circular_buffer_entry_at(buffer,index); \
+            index<aesd_circular_buffer_count(buffer); \
+            index++, entryptr=aesd_circular_buffer_entry_at(buffer,index))
 
 
 
@@ -38,9 +38,36 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// With a nonzero argument, reads of this open file block at the end of the data until more is written,
+// like tail -f; with 0 they return end of file there again, the default
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 2, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 2
+
+/**
+ * First page of a read-only mmap of the device, at offset 0. The data area follows in the next
+ * page, data_size bytes, and then the same data area once more, so that any range of data_size
+ * bytes is contiguous in the mapping.
+ *
+ * Offsets count all bytes ever written to the device as complete records. The byte at offset o is
+ * at o % data_size in the data area while start_offset <= o < end_offset; end_offset is the tail.
+ * The device holds the same records as read() returns, but the area may keep fewer bytes of them
+ * than the device retains.
+ *
+ * generation works like a seqlock: it is odd while a writer updates the area. A reader loads it
+ * (acquire), retries if it is odd, reads start_offset and end_offset and the bytes it wants,
+ * and loads generation again after a read barrier; the bytes are valid if both loads match.
+ * Until then the offsets may come from different updates: before touching the data, a reader
+ * must check that start_offset <= end_offset and end_offset - start_offset <= data_size, and
+ * retry otherwise.
+ */
+struct aesd_mmap_header {
+    uint64_t generation;
+    uint64_t start_offset;
+    uint64_t end_offset;
+    uint64_t data_size;
+};
 
 #endif /* AESD_IOCTL_H */
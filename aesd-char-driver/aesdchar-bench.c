@@ -0,0 +1,349 @@
+/**
+ * @file aesdchar-bench.c
+ * @brief Userspace benchmark for the aesdchar device.
+ *
+ * Usage: aesdchar-bench [-d device] [-n writes] [-l record_len] [-t readers]
+ *                       [-w writers]
+ *
+ * Times writes carrying 1 and 1000 newline-terminated records each, then
+ * has the reader threads read the whole device over and over for the same
+ * duration and reports the read rate and the read() calls per pass.
+ * Finally it counts the records through a read-only mmap of the device
+ * for the same duration, with no syscalls per pass.
+ *
+ * With -w, writer threads then write single records for the same duration,
+ * first all to the device and then each to its own device, named after the
+ * device with the thread index appended (/dev/aesdchar0, /dev/aesdchar1, ...
+ * with the module loaded with minors=writers).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd_ioctl.h"
+
+#define READ_SECONDS 2
+#define READ_BUFFER_SIZE (64 * 1024)
+
+static const char *device = "/dev/aesdchar";
+static volatile bool readers_stop;
+static volatile bool writers_stop;
+
+struct writer_args {
+    char path[64];
+    size_t record_len;
+    unsigned long writes;
+    int error;
+};
+
+struct reader_stats {
+    unsigned long passes;
+    unsigned long calls;
+    unsigned long long bytes;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Time writes of records_per_write records of record_len bytes each
+static int bench_write(int writes, int records_per_write, size_t record_len)
+{
+    size_t len = (size_t)records_per_write * record_len;
+    char *data = malloc(len);
+    double start, elapsed;
+    int fd;
+
+    if (!data) {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        data[i] = (i + 1) % record_len == 0 ? '\n' : 'a' + i % 26;
+    }
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", device, strerror(errno));
+        free(data);
+        return -1;
+    }
+
+    start = now_s();
+    for (int i = 0; i < writes; i++) {
+        if (write(fd, data, len) != (ssize_t)len) {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            close(fd);
+            free(data);
+            return -1;
+        }
+    }
+    elapsed = now_s() - start;
+    printf("%4d records/write: %8.0f writes/s %10.0f records/s %8.1f MB/s\n",
+           records_per_write, writes / elapsed,
+           (double)writes * records_per_write / elapsed,
+           (double)writes * len / elapsed / 1e6);
+    close(fd);
+    free(data);
+    return 0;
+}
+
+static void *reader(void *arg)
+{
+    struct reader_stats *stats = arg;
+    char *buffer = malloc(READ_BUFFER_SIZE);
+    int fd = open(device, O_RDONLY);
+    ssize_t n;
+
+    if (fd < 0 || !buffer) {
+        fprintf(stderr, "reader: %s\n", strerror(errno));
+        free(buffer);
+        return NULL;
+    }
+    while (!readers_stop) {
+        lseek(fd, 0, SEEK_SET);
+        do {
+            n = read(fd, buffer, READ_BUFFER_SIZE);
+            stats->calls++;
+            if (n > 0)
+                stats->bytes += n;
+        } while (n > 0);
+        stats->passes++;
+    }
+    close(fd);
+    free(buffer);
+    return NULL;
+}
+
+// Read the whole device from threads readers concurrently
+static int bench_read(int threads)
+{
+    pthread_t *ids = calloc(threads, sizeof(*ids));
+    struct reader_stats *stats = calloc(threads, sizeof(*stats));
+    struct reader_stats total = {0};
+
+    if (!ids || !stats) {
+        perror("calloc");
+        free(ids);
+        free(stats);
+        return -1;
+    }
+    readers_stop = false;
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, reader, &stats[i]);
+    }
+    sleep(READ_SECONDS);
+    readers_stop = true;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        total.passes += stats[i].passes;
+        total.calls += stats[i].calls;
+        total.bytes += stats[i].bytes;
+    }
+    if (total.passes > 0) {
+        printf("%d readers: %10.0f passes/s %8.1f MB/s %6.2f read() calls/pass\n",
+               threads, total.passes / (double)READ_SECONDS,
+               total.bytes / (double)READ_SECONDS / 1e6,
+               (double)total.calls / total.passes);
+    }
+    free(ids);
+    free(stats);
+    return 0;
+}
+
+static void *writer(void *arg)
+{
+    struct writer_args *args = arg;
+    char *record = malloc(args->record_len);
+    int fd = open(args->path, O_WRONLY);
+
+    if (fd < 0 || !record) {
+        fprintf(stderr, "open %s: %s\n", args->path, strerror(errno));
+        args->error = 1;
+        free(record);
+        return NULL;
+    }
+    memset(record, 'w', args->record_len - 1);
+    record[args->record_len - 1] = '\n';
+    while (!writers_stop) {
+        if (write(fd, record, args->record_len) != (ssize_t)args->record_len) {
+            fprintf(stderr, "write %s: %s\n", args->path, strerror(errno));
+            args->error = 1;
+            break;
+        }
+        args->writes++;
+    }
+    close(fd);
+    free(record);
+    return NULL;
+}
+
+// Write from threads writers concurrently, to the device or each to its own
+static int bench_parallel_write(int threads, size_t record_len, bool own_device)
+{
+    pthread_t *ids = calloc(threads, sizeof(*ids));
+    struct writer_args *args = calloc(threads, sizeof(*args));
+    unsigned long total = 0;
+    int error = 0;
+
+    if (!ids || !args) {
+        perror("calloc");
+        free(ids);
+        free(args);
+        return -1;
+    }
+    writers_stop = false;
+    for (int i = 0; i < threads; i++) {
+        if (own_device)
+            snprintf(args[i].path, sizeof(args[i].path), "%s%d", device, i);
+        else
+            snprintf(args[i].path, sizeof(args[i].path), "%s", device);
+        args[i].record_len = record_len;
+        pthread_create(&ids[i], NULL, writer, &args[i]);
+    }
+    sleep(READ_SECONDS);
+    writers_stop = true;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        total += args[i].writes;
+        error |= args[i].error;
+    }
+    if (!error) {
+        printf("%d writers, %s: %10.0f writes/s\n", threads,
+               own_device ? "own devices" : "one device ", total / (double)READ_SECONDS);
+    }
+    free(ids);
+    free(args);
+    return error ? -1 : 0;
+}
+
+// Count records in the mmap area, retrying passes that overlapped a write
+static int bench_mmap(void)
+{
+    const struct aesd_mmap_header *header;
+    size_t map_len;
+    unsigned long passes = 0, retries = 0;
+    unsigned long long bytes = 0, records = 0;
+    double start, elapsed;
+    int fd = open(device, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", device, strerror(errno));
+        return -1;
+    }
+    // Map the header page first to learn the size of the data area
+    header = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    map_len = sysconf(_SC_PAGESIZE) + 2 * header->data_size;
+    munmap((void *)header, sysconf(_SC_PAGESIZE));
+    header = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return -1;
+    }
+
+    start = now_s();
+    do {
+        const char *data = (const char *)header + sysconf(_SC_PAGESIZE);
+        uint64_t generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+        uint64_t first = header->start_offset, last = header->end_offset;
+        const char *p = data + first % header->data_size;
+        const char *end = p + (last - first);
+        unsigned long pass_records = 0;
+
+        // Offsets read during an update may not belong together; scanning them could leave the mapping
+        if ((generation & 1) || last < first || last - first > header->data_size) {
+            retries++;
+            continue;
+        }
+        // The data area is mapped twice, so the range is contiguous
+        while ((p = memchr(p, '\n', end - p))) {
+            p++;
+            pass_records++;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->generation, __ATOMIC_RELAXED) != generation) {
+            retries++;
+            continue;
+        }
+        passes++;
+        bytes += last - first;
+        records += pass_records;
+    } while (now_s() - start < READ_SECONDS);
+    elapsed = now_s() - start;
+
+    printf("mmap scan: %10.0f passes/s %8.1f MB/s %6.0f records/pass %lu retries\n",
+           passes / elapsed, bytes / elapsed / 1e6,
+           passes ? (double)records / passes : 0.0, retries);
+    munmap((void *)header, map_len);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int writes = 10000;
+    size_t record_len = 32;
+    int readers = 4;
+    int writers = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:l:t:w:")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'n':
+            writes = atoi(optarg);
+            break;
+        case 'l':
+            record_len = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            readers = atoi(optarg);
+            break;
+        case 'w':
+            writers = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-n writes] [-l record_len] [-t readers] [-w writers]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (writes <= 0 || record_len < 2 || readers < 0 || writers < 0) {
+        fprintf(stderr, "writes must be positive, record_len at least 2\n");
+        return 1;
+    }
+
+    if (bench_write(writes, 1, record_len) < 0 ||
+        bench_write(writes / 100 > 0 ? writes / 100 : 1, 1000, record_len) < 0) {
+        return 1;
+    }
+    for (int threads = 1; threads <= readers; threads *= 2) {
+        if (bench_read(threads) < 0)
+            return 1;
+    }
+    if (bench_mmap() < 0)
+        return 1;
+    if (writers > 0 &&
+        (bench_parallel_write(writers, record_len, false) < 0 ||
+         bench_parallel_write(writers, record_len, true) < 0)) {
+        return 1;
+    }
+    return 0;
+}
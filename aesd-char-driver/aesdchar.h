@@ -24,15 +24,77 @@
 #endif
 
 #include "aesd-circular-buffer.h"
+#include <linux/cache.h>
+#include <linux/device.h>
+#include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/wait.h>
+
+/*
+ * Memory behind an entry's buffptr. The writers' circular buffer holds a
+ * reference, and so does a reader while it copies from it. The memory is
+ * freed a grace period after the last reference is dropped, so readers
+ * can still look at records of a snapshot published before the eviction.
+ */
+struct aesd_record
+{
+    struct kref ref;
+    u8 size_class;        /* Cache the record came from, AESD_RECORD_KMALLOC if none */
+    struct rcu_head rcu;
+    char data[];
+};
+
+/*
+ * Position of the retained entries, published to readers with RCU. Its
+ * buffer indexes the writers' entry storage, which has room for twice the
+ * depth: entries added after publication go to slots the snapshot doesn't
+ * list until depth more were added, and readers check added to notice
+ * that. Writers publish a new one after every change; the old one is
+ * freed after a grace period. It holds no record references: records it
+ * lists are evicted only after the snapshot that replaces it is published.
+ */
+struct aesd_snapshot
+{
+    struct rcu_head rcu;
+    unsigned long added;  /* Entries added to the writers' buffer when published */
+    struct aesd_circular_buffer buffer; /* Shares the entry storage of the writers' buffer */
+};
+
+/*
+ * Bytes allocated for a snapshot: its buffer never uses the inline storage,
+ * which comes last, so that is left out.
+ */
+#define AESD_SNAPSHOT_SIZE offsetof(struct aesd_snapshot, buffer.inline_entry)
 
 struct aesd_dev
 {
     struct cdev cdev;     /* Char device structure */
-    struct aesd_circular_buffer buffer; /* Circular buffer for storing data */
-    struct mutex lock;    /* Mutex for synchronizing access */
+    struct aesd_circular_buffer buffer; /* Writers' copy of the circular buffer */
+    struct aesd_snapshot __rcu *snapshot; /* What readers see, see above */
+    unsigned long added;  /* Entries ever added to buffer, counted before the slot is written */
+    struct mutex lock;    /* Serializes writers (the commit step) */
+    wait_queue_head_t wait; /* Woken when a snapshot is published */
     char *partial_write;  /* Buffer for incomplete write operations */
     size_t partial_write_size; /* Size of the incomplete write buffer */
+    size_t max_bytes;     /* Byte budget of the retained records, 0 for none */
+    size_t record_memory; /* Memory allocated for the retained records */
+    struct device *device; /* Device in sysfs, carrying the attributes above */
+    void *mirror;         /* Area shared by mmap once first mapped: header page, then the data area */
+    size_t mirror_size;   /* Size of the data area, a power of two */
+    uint64_t mirrored_end; /* Offset up to which records are copied to the data area */
+} ____cacheline_aligned_in_smp; /* Devices sit in one array; no cache line is shared between them */
+
+/*
+ * State of an open file. f_pos counts from the oldest byte retained when it
+ * was last set; base is that byte's offset in the buffer, so the position
+ * keeps pointing at the same data when older records are evicted.
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    uint64_t base;
+    bool follow;          /* Reads block at the end of the data, set with AESDCHAR_IOCFOLLOW */
 };
 
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset);
@@ -14,14 +14,21 @@ modprobe $module.ko $* || exit 1
 echo "Get the major number (allocated with allocate_chrdev_region) from /proc/devices"
 major=$(awk "\$2==\"$module\" {print \$1}" /proc/devices)
 if [ ! -z ${major} ]; then
-    echo "Remove any existing /dev node for /dev/${device}"
-    rm -f /dev/${device}
-    echo "Add a node for our device at /dev/${device} using mknod"
-    mknod /dev/${device} c $major 0
-    echo "Change group owner to ${group}"
-    chgrp $group /dev/${device}
-    echo "Change access mode to ${mode}"
-    chmod $mode  /dev/${device}
+    minors=$(cat /sys/module/${module}/parameters/minors)
+    echo "Remove any existing /dev nodes for /dev/${device}"
+    rm -f /dev/${device} /dev/${device}[0-9]*
+    minor=0
+    while [ $minor -lt $minors ]; do
+        echo "Add a node for device ${minor} at /dev/${device}${minor} using mknod"
+        mknod /dev/${device}${minor} c $major $minor
+        echo "Change group owner to ${group}"
+        chgrp $group /dev/${device}${minor}
+        echo "Change access mode to ${mode}"
+        chmod $mode  /dev/${device}${minor}
+        minor=$((minor + 1))
+    done
+    echo "Link /dev/${device} to the first device"
+    ln -s ${device}0 /dev/${device}
 else
     echo "No device found in /proc/devices for driver ${module} (this driver may not allocate a device)"
 fi
@@ -15,10 +15,23 @@
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
+#include <linux/kernel.h> // for kstrtouint
+#include <linux/log2.h> // for roundup_pow_of_two
+#include <linux/moduleparam.h> // for the ring_depth parameter
 #include <linux/cdev.h>
+#include <linux/device.h> // for the class, device and sysfs attributes
+#include <linux/version.h>
 #include <linux/fs.h> // file_operations
-#include <linux/slab.h> // for kmalloc and kfree
+#include <linux/slab.h> // for kmalloc, kvcalloc and kfree
 #include <linux/mutex.h> // for mutex
+#include <linux/rcupdate.h> // for RCU publication of the circular buffer
+#include <linux/string.h> // for memchr and kmemdup
+#include <linux/mm.h> // for mmap
+#include <linux/vmalloc.h> // for the mmap area
+#include <linux/poll.h> // for poll
+#include <linux/wait.h> // for the wait queue of blocking reads
+#include <linux/uio.h> // for iov_iter
+#include <linux/splice.h> // for the splice helpers
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
 #include "aesd_ioctl.h"
@@ -32,7 +45,50 @@ const char* RESET = "\033[0m";
 MODULE_AUTHOR("andy314dn");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+/*
+ * Largest number of devices accepted.
+ */
+#define AESDCHAR_MAX_MINORS 256
+
+static unsigned int minors = 1;
+module_param(minors, uint, 0444);
+MODULE_PARM_DESC(minors, "Number of devices, aesdchar0 to aesdchar<minors-1>, each with its own records (1-256)");
+
+struct aesd_dev *aesd_devices; // minors entries
+static struct class *aesd_class;
+
+static unsigned long max_bytes;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Initial byte budget of the retained records, 0 for none; set per device in sysfs");
+
+static unsigned long mmap_size = 1024 * 1024;
+module_param(mmap_size, ulong, 0444);
+MODULE_PARM_DESC(mmap_size, "Bytes of history each device exposes to mmap, rounded up to a power of two; 0 disables mmap");
+
+/*
+ * Record caches, from 64 to 2048 bytes per object including the record header. The sizes grow by
+ * half a step at a time, so a record wastes at most a third of its object, against half with the
+ * power-of-two kmalloc caches. Larger records come from kmalloc.
+ */
+static const struct {
+    unsigned int size;
+    const char *name;
+} aesd_record_classes[] = {
+    { 64, "aesdchar_record_64" },
+    { 96, "aesdchar_record_96" },
+    { 128, "aesdchar_record_128" },
+    { 192, "aesdchar_record_192" },
+    { 256, "aesdchar_record_256" },
+    { 384, "aesdchar_record_384" },
+    { 512, "aesdchar_record_512" },
+    { 768, "aesdchar_record_768" },
+    { 1024, "aesdchar_record_1024" },
+    { 1536, "aesdchar_record_1536" },
+    { 2048, "aesdchar_record_2048" },
+};
+#define AESD_RECORD_KMALLOC 0xff
+
+static struct kmem_cache *aesd_record_caches[ARRAY_SIZE(aesd_record_classes)];
 
 /**
  * @brief Associate the device structure with the file pointer for future operations.
@@ -40,13 +96,23 @@ struct aesd_dev aesd_device;
  * @param inode: Represents the device file in the filesystem.
  * @param filp: File pointer for the opened file, used to store private data.
  * 
- * @return 0 on success.
+ * @return 0 on success, or -ENOMEM.
  */
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
+
     PDEBUG("open");
-    // Sets filp->private_data to point to the aesd_dev structure, retrieved via container_of from inode->i_cdev.
-    filp->private_data = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    file = kmalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    // Sets filp->private_data to an aesd_file for the aesd_dev structure, retrieved via container_of from inode->i_cdev.
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    rcu_read_lock();
+    file->base = rcu_dereference(file->dev->snapshot)->buffer.start_offset;
+    rcu_read_unlock();
+    file->follow = false;
+    filp->private_data = file;
     return 0;
 }
 
@@ -61,227 +127,740 @@ int aesd_open(struct inode *inode, struct file *filp)
 int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
+    kfree(filp->private_data);
     return 0;
 }
 
 /**
- * @brief Reads data from the circular buffer and copies it to user space.
- * 
- * @param filp: File pointer containing the device structure in private_data.
- * @param buf: User-space buffer to copy data into.
- * @param count: Number of bytes requested to read.
- * @param f_pos: File position offset for reading.
- * 
- * @return Number of bytes read, 0 for EOF, or -EFAULT on copy failure.
+ * @brief Allocates a record with room for size bytes, holding one reference.
+ *
+ * @param size: Number of data bytes.
+ *
+ * @return The record, or NULL if out of memory.
+ */
+static struct aesd_record *aesd_record_alloc(size_t size)
+{
+    struct aesd_record *record;
+    u8 size_class;
+
+    for (size_class = 0; size_class < ARRAY_SIZE(aesd_record_classes); size_class++) {
+        if (sizeof(*record) + size <= aesd_record_classes[size_class].size)
+            break;
+    }
+    if (size_class < ARRAY_SIZE(aesd_record_classes)) {
+        record = kmem_cache_alloc(aesd_record_caches[size_class], GFP_KERNEL);
+    } else {
+        size_class = AESD_RECORD_KMALLOC;
+        record = kmalloc(sizeof(*record) + size, GFP_KERNEL);
+    }
+
+    if (record) {
+        kref_init(&record->ref);
+        record->size_class = size_class;
+    }
+    return record;
+}
+
+/**
+ * @brief Finds the record an entry's buffptr points into.
+ */
+static struct aesd_record *aesd_record_of(const struct aesd_buffer_entry *entry)
+{
+    return (struct aesd_record *)((char *)entry->buffptr - offsetof(struct aesd_record, data));
+}
+
+static void aesd_record_free_rcu(struct rcu_head *rcu)
+{
+    struct aesd_record *record = container_of(rcu, struct aesd_record, rcu);
+
+    if (record->size_class == AESD_RECORD_KMALLOC)
+        kfree(record);
+    else
+        kmem_cache_free(aesd_record_caches[record->size_class], record);
+}
+
+static void aesd_record_release(struct kref *ref)
+{
+    struct aesd_record *record = container_of(ref, struct aesd_record, ref);
+
+    // Readers of an older snapshot may still be looking at it
+    call_rcu(&record->rcu, aesd_record_free_rcu);
+}
+
+static void aesd_record_put(struct aesd_record *record)
+{
+    kref_put(&record->ref, aesd_record_release);
+}
+
+/**
+ * @brief Drops the record references held by the entries of a circular buffer.
+ */
+static void aesd_buffer_put_records(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        if (entry->buffptr)
+            aesd_record_put(aesd_record_of(entry));
+    }
+}
+
+/**
+ * @brief Memory taken by the record behind an entry, for the memory sysfs attribute.
+ */
+static size_t aesd_record_footprint(const struct aesd_buffer_entry *entry)
+{
+    u8 size_class = aesd_record_of(entry)->size_class;
+
+    if (size_class == AESD_RECORD_KMALLOC)
+        return sizeof(struct aesd_record) + entry->size;
+    return aesd_record_classes[size_class].size;
+}
+
+/**
+ * @brief Updates the record memory of the device for an entry entering or leaving the writers' buffer.
+ * Must be called with dev->lock held.
+ */
+static void aesd_account(struct aesd_dev *dev, const struct aesd_buffer_entry *entry, bool add)
+{
+    if (add)
+        dev->record_memory += aesd_record_footprint(entry);
+    else
+        dev->record_memory -= aesd_record_footprint(entry);
+}
+
+/**
+ * @brief Removes the oldest records until the retained bytes fit the budget, always keeping the newest
+ * record. Must be called with dev->lock held.
+ *
+ * The removed entries stay in their slots of dev->buffer, starting at *first_slot, until an entry is
+ * added; release them with aesd_put_removed once the snapshot without them is published.
+ *
+ * @param dev: The device.
+ * @param first_slot: Set to the slot of the first removed entry.
+ *
+ * @return Number of records removed.
+ */
+static uint32_t aesd_enforce_budget(struct aesd_dev *dev, uint32_t *first_slot)
+{
+    uint32_t removed = 0;
+
+    *first_slot = dev->buffer.out_offs;
+    while (dev->max_bytes && aesd_circular_buffer_size(&dev->buffer) > dev->max_bytes &&
+           aesd_circular_buffer_count(&dev->buffer) > 1) {
+        aesd_account(dev, aesd_circular_buffer_remove_entry(&dev->buffer), false);
+        removed++;
+    }
+    return removed;
+}
+
+/**
+ * @brief Drops the references of entries removed by aesd_enforce_budget. Must be called with dev->lock held,
+ * after publishing.
+ */
+static void aesd_put_removed(struct aesd_dev *dev, uint32_t first_slot, uint32_t removed)
+{
+    uint32_t i;
+
+    for (i = 0; i < removed; i++)
+        aesd_record_put(aesd_record_of(&dev->buffer.entry[(first_slot + i) & dev->buffer.mask]));
+}
+
+/**
+ * @brief Adds an entry to the writers' circular buffer. Must be called with dev->lock held.
+ *
+ * The slot written may be listed by a snapshot published long enough ago; counting the entry first lets
+ * readers of that snapshot notice, see aesd_snapshot_stale.
+ */
+static void aesd_add_entry(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    WRITE_ONCE(dev->added, dev->added + 1);
+    smp_wmb();
+    aesd_circular_buffer_add_entry(&dev->buffer, entry);
+}
+
+/**
+ * @brief Tells whether writers may have reused slots listed by a snapshot since it was published. Call it
+ * in the RCU read-side section that found the snapshot, after reading its entries: if it returns false, the
+ * values read are those published.
+ */
+static bool aesd_snapshot_stale(struct aesd_dev *dev, const struct aesd_snapshot *snapshot)
+{
+    const struct aesd_circular_buffer *buffer = &snapshot->buffer;
+
+    // Pairs with aesd_add_entry; the oldest listed slot is reused by the (capacity - count + 1)th entry added
+    smp_rmb();
+    return READ_ONCE(dev->added) - snapshot->added > buffer->mask + 1 - aesd_circular_buffer_count(buffer);
+}
+
+/**
+ * @brief Copies bytes to the data area of the mmap mirror at their offset, wrapping around its end.
+ */
+static void aesd_mirror_copy(struct aesd_dev *dev, uint64_t offset, const char *src, size_t len)
+{
+    char *data = (char *)dev->mirror + PAGE_SIZE;
+    size_t pos = offset & (dev->mirror_size - 1);
+    size_t head = min(len, dev->mirror_size - pos);
+
+    memcpy(data + pos, src, head);
+    memcpy(data, src + head, len - head);
+}
+
+/**
+ * @brief Brings the mmap mirror up to date with the writers' circular buffer, if it is mapped. Must be called
+ * with dev->lock held.
+ *
+ * The data area keeps the newest mirror_size bytes at most. Only bytes added since the last update are
+ * copied; records added and evicted again in between are skipped.
  */
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static void aesd_mirror_update(struct aesd_dev *dev)
 {
-    ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_mmap_header *header = dev->mirror;
+    struct aesd_circular_buffer *buffer = &dev->buffer;
     struct aesd_buffer_entry *entry;
+    uint64_t end = buffer->end_offset;
+    uint64_t start = end > dev->mirror_size ? end - dev->mirror_size : 0;
+    uint64_t from;
     size_t entry_offset;
-    size_t bytes_to_copy;
+    uint32_t n;
+
+    if (!header)
+        return;
+    start = max(start, buffer->start_offset);
+    from = max(dev->mirrored_end, start);
+
+    // An odd generation tells readers the area is changing
+    WRITE_ONCE(header->generation, header->generation + 1);
+    smp_wmb();
+    WRITE_ONCE(header->start_offset, start);
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, from - buffer->start_offset, &entry_offset);
+    if (entry) {
+        n = ((uint32_t)(entry - buffer->entry) - buffer->out_offs) & buffer->mask;
+        for (; from < end; n++) {
+            entry = aesd_circular_buffer_entry_at(buffer, n);
+            aesd_mirror_copy(dev, from, entry->buffptr + entry_offset, entry->size - entry_offset);
+            from += entry->size - entry_offset;
+            entry_offset = 0;
+        }
+    }
+    dev->mirrored_end = end;
+    WRITE_ONCE(header->end_offset, end);
 
-    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
 
-    // Locks the device mutex to ensure thread-safe access to the circular buffer.
-    if (mutex_lock_interruptible(&dev->lock))
+/**
+ * @brief Publishes the writers' circular buffer to readers. Must be called with dev->lock held.
+ *
+ * Only the position of the entries is published, in constant time: readers index the writers' entry
+ * storage. Records the previous snapshot lists must stay referenced until this returns; dropping them
+ * afterwards defers their release past every reader that can still see the previous snapshot.
+ *
+ * @param dev: The device.
+ * @param snapshot: Snapshot allocated with AESD_SNAPSHOT_SIZE bytes, owned by the device afterwards.
+ */
+static void aesd_publish(struct aesd_dev *dev, struct aesd_snapshot *snapshot)
+{
+    struct aesd_circular_buffer *buffer = &dev->buffer;
+    struct aesd_snapshot *old;
+
+    aesd_circular_buffer_init_storage(&snapshot->buffer, buffer->entry, buffer->mask + 1, buffer->depth);
+    snapshot->buffer.in_offs = buffer->in_offs;
+    snapshot->buffer.out_offs = buffer->out_offs;
+    snapshot->buffer.full = buffer->full;
+    snapshot->buffer.start_offset = buffer->start_offset;
+    snapshot->buffer.end_offset = buffer->end_offset;
+    snapshot->added = dev->added;
+    aesd_mirror_update(dev);
+
+    old = rcu_dereference_protected(dev->snapshot, lockdep_is_held(&dev->lock));
+    rcu_assign_pointer(dev->snapshot, snapshot);
+    if (old)
+        kfree_rcu(old, rcu);
+
+    // Wakes blocked followers and pollers
+    wake_up_interruptible(&dev->wait);
+}
+
+/**
+ * @brief Changes the number of records the device retains, dropping the oldest ones if it shrinks.
+ *
+ * @param dev: The device.
+ * @param depth: New depth, between 1 and AESDCHAR_MAX_RING_DEPTH.
+ *
+ * @return 0 on success, -ENOMEM or -ERESTARTSYS.
+ */
+static int aesd_resize(struct aesd_dev *dev, uint32_t depth)
+{
+    // Twice the depth, so that slots published to readers aren't reused by the next depth entries added
+    uint32_t capacity = roundup_pow_of_two(2 * depth);
+    struct aesd_circular_buffer resized;
+    struct aesd_circular_buffer dropped;
+    struct aesd_buffer_entry *storage;
+    struct aesd_buffer_entry *old_storage = NULL;
+    struct aesd_snapshot *snapshot;
+    uint32_t count;
+    uint32_t i;
+
+    storage = kvcalloc(capacity, sizeof(*storage), GFP_KERNEL);
+    snapshot = kmalloc(AESD_SNAPSHOT_SIZE, GFP_KERNEL);
+    if (!storage || !snapshot) {
+        kvfree(storage);
+        kfree(snapshot);
+        return -ENOMEM;
+    }
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        kvfree(storage);
+        kfree(snapshot);
         return -ERESTARTSYS;
+    }
 
-    // Finds the buffer entry and offset for the current file position using aesd_circular_buffer_find_entry_offset_for_fpos.
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset);
-    if (!entry || !entry->buffptr || entry->size == 0) {
-        retval = 0; // EOF or invalid entry
-        goto out;
+    // Migrate the newest records into the new storage, remembering the ones that no longer fit
+    dropped = dev->buffer;
+    if (dropped.entry == dev->buffer.inline_entry)
+        dropped.entry = dropped.inline_entry;
+    else
+        old_storage = dropped.entry;
+    count = aesd_circular_buffer_count(&dropped);
+    for (i = 0; i + depth < count; i++)
+        aesd_account(dev, aesd_circular_buffer_entry_at(&dropped, i), false);
+    aesd_circular_buffer_copy(&resized, storage, capacity, depth, &dev->buffer);
+    dev->buffer = resized;
+    aesd_publish(dev, snapshot);
+    mutex_unlock(&dev->lock);
+
+    // Readers of the previous snapshot may still see the dropped records, which are released after them,
+    // and index the old storage, which is freed after them
+    for (i = 0; i + depth < count; i++)
+        aesd_record_put(aesd_record_of(aesd_circular_buffer_entry_at(&dropped, i)));
+    if (old_storage) {
+        synchronize_rcu();
+        kvfree(old_storage);
     }
 
-    // Validates the entry's buffptr and size to prevent invalid memory access.
-    bytes_to_copy = min(count, entry->size - entry_offset);
-    if (bytes_to_copy == 0) {
-        retval = 0; // No more data in this entry
-        goto out;
+    PDEBUG("ring depth %u, capacity %u", depth, capacity);
+    return 0;
+}
+
+/*
+ * Part of an entry pinned by aesd_read_iter for copying to user space.
+ */
+struct aesd_read_segment
+{
+    struct aesd_record *record;
+    const char *data;
+    size_t size;
+};
+
+/*
+ * Entries aesd_read_iter pins per RCU read-side section; with deep rings a long read takes several passes.
+ */
+#define AESD_READ_SEGMENTS 16
+
+/**
+ * @brief Pins consecutive entries of the published snapshot, starting at an offset in the buffer.
+ *
+ * @param dev: The device.
+ * @param offset: Offset of the first byte; moved up to the oldest retained byte if that one is newer.
+ * @param start: Set to the offset of the oldest byte in the snapshot.
+ * @param wanted: Number of bytes wanted.
+ * @param segments: Array of AESD_READ_SEGMENTS segments to fill.
+ *
+ * @return Number of segments filled, fewer than AESD_READ_SEGMENTS once the end of the data is reached.
+ */
+static size_t aesd_read_pin(struct aesd_dev *dev, uint64_t *offset, uint64_t *start, size_t wanted,
+                            struct aesd_read_segment *segments)
+{
+    struct aesd_snapshot *snapshot;
+    struct aesd_circular_buffer *buffer;
+    struct aesd_buffer_entry *entry;
+    size_t num_segments;
+    size_t left;
+    size_t entry_offset;
+    uint32_t count;
+    uint32_t n;
+    size_t i;
+
+    rcu_read_lock();
+retry:
+    snapshot = rcu_dereference(dev->snapshot);
+    buffer = &snapshot->buffer;
+    num_segments = 0;
+    left = wanted;
+    *start = buffer->start_offset;
+    *offset = max(*offset, buffer->start_offset);
+    // Finds the buffer entry and offset for the current file position using aesd_circular_buffer_find_entry_offset_for_fpos.
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, *offset - buffer->start_offset, &entry_offset);
+    if (entry) {
+        // Entries from the one found up to the newest
+        count = aesd_circular_buffer_count(buffer);
+        n = ((uint32_t)(entry - buffer->entry) - buffer->out_offs) & buffer->mask;
+
+        for (; left > 0 && n < count && num_segments < AESD_READ_SEGMENTS; n++) {
+            entry = aesd_circular_buffer_entry_at(buffer, n);
+            // Validates the entry's buffptr and size to prevent invalid memory access.
+            if (entry->buffptr && entry->size > entry_offset) {
+                struct aesd_read_segment *segment = &segments[num_segments];
+
+                segment->record = aesd_record_of(entry);
+                segment->data = entry->buffptr + entry_offset;
+                segment->size = min(left, entry->size - entry_offset);
+                left -= segment->size;
+                num_segments++;
+            }
+            entry_offset = 0;
+        }
     }
+    // A writer reused slots read above; look again at the newer snapshot
+    if (aesd_snapshot_stale(dev, snapshot))
+        goto retry;
+
+    // The records stay allocated for the grace period, but a writer may have dropped them already; it
+    // published the snapshot without them first, so look again at that one
+    for (i = 0; i < num_segments; i++) {
+        if (!kref_get_unless_zero(&segments[i].record->ref)) {
+            while (i--)
+                aesd_record_put(segments[i].record);
+            goto retry;
+        }
+    }
+    rcu_read_unlock();
+    return num_segments;
+}
 
-    // Copies the minimum of requested bytes or remaining entry bytes to user space.
-    if (copy_to_user(buf, entry->buffptr + entry_offset, bytes_to_copy)) {
-        retval = -EFAULT;
-        goto out;
+/**
+ * @brief Offset just past the newest byte published to readers.
+ */
+static uint64_t aesd_end_offset(struct aesd_dev *dev)
+{
+    uint64_t end;
+
+    rcu_read_lock();
+    end = rcu_dereference(dev->snapshot)->buffer.end_offset;
+    rcu_read_unlock();
+    return end;
+}
+
+/**
+ * @brief Reads data from the circular buffer and copies it to the iterator.
+ *
+ * Readers take no lock: starting at the entry for the file position, consecutive entries are collected
+ * from the snapshot published with RCU in a single read-side section and their records are pinned with
+ * references. The copies, which can fault and sleep, then run concurrently with other readers and with
+ * writers. One call fills the iterator across as many entries as it holds, pinning up to
+ * AESD_READ_SEGMENTS of them at a time. A position whose data was evicted since it was set continues
+ * at the oldest retained byte.
+ *
+ * Serves read() and readv() as well as splice() and sendfile(), which copy into pipe pages.
+ *
+ * At the end of the data, reads return 0 unless the file asked to follow with AESDCHAR_IOCFOLLOW: then
+ * they sleep until more records are written, or fail with -EAGAIN for O_NONBLOCK files and IOCB_NOWAIT
+ * requests.
+ * 
+ * @param iocb: The request, with the file (aesd_file in private_data) and the file position.
+ * @param to: Destination of the data.
+ * 
+ * @return Number of bytes read, 0 for EOF, or -EFAULT, -EAGAIN or -ERESTARTSYS.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct aesd_file *file = filp->private_data;
+    size_t count = iov_iter_count(to);
+    loff_t *f_pos = &iocb->ki_pos;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_read_segment segments[AESD_READ_SEGMENTS];
+    uint64_t offset = file->base + *f_pos;
+    uint64_t start;
+    size_t num_segments;
+    size_t copied = 0;
+    bool faulted = false;
+    size_t i;
+
+    PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
+
+    if (count == 0)
+        return 0;
+
+    // Followers at the end wait for the end to move past their offset
+    if (READ_ONCE(file->follow) && aesd_end_offset(dev) <= offset) {
+        if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->wait, aesd_end_offset(dev) > offset))
+            return -ERESTARTSYS;
     }
 
-    // Updates file position and returns the number of bytes read, or 0 for EOF, or -EFAULT on copy failure.
-    *f_pos += bytes_to_copy;
-    retval = bytes_to_copy;
+    do {
+        num_segments = aesd_read_pin(dev, &offset, &start, count - copied, segments);
 
-out:
-    mutex_unlock(&dev->lock);
-    return retval;
+        // Copies the pinned segments; a fault after some data was copied ends the read short.
+        for (i = 0; i < num_segments; i++) {
+            if (!faulted) {
+                size_t done = copy_to_iter(segments[i].data, segments[i].size, to);
+
+                copied += done;
+                offset += done;
+                faulted = done != segments[i].size;
+            }
+            aesd_record_put(segments[i].record);
+        }
+    } while (num_segments == AESD_READ_SEGMENTS && !faulted && copied < count);
+
+    if (faulted && copied == 0)
+        return -EFAULT;
+
+    // Updates file position, relative to the oldest byte of the last snapshot, and returns the number of bytes read, or 0 for EOF.
+    file->base = start;
+    *f_pos = offset - start;
+    return copied;
 }
 
+/*
+ * Surviving records up to which aesd_write_iter keeps its bookkeeping on the stack. It remembers the record
+ * ends of the surviving records plus the end of the record before the oldest of them, which is where it starts.
+ */
+#define AESD_WRITE_INLINE 16
+
 /**
- * @brief Writes data from user space to the device, handling partial writes and newline-terminated entries.
+ * @brief Writes data from the iterator to the device, handling partial writes and newline-terminated entries.
+ *
+ * The data is copied once, so the buffers of a writev() are committed together as if they were one
+ * write, and only the new bytes are scanned: a pending partial write holds no
+ * newline. Every complete record is committed, each in an allocation of its exact size. Records that
+ * the same write pushes out of the circular buffer again are never allocated. Everything that doesn't
+ * depend on device state happens before dev->lock is taken; under the lock the first record is joined
+ * with the partial write, the records are committed and the result is published to readers. Evicted
+ * records are released after the lock is dropped.
  * 
- * @param filp: File pointer containing the device structure in private_data.
- * @param buf: User-space buffer containing data to write.
- * @param count: Number of bytes to write.
- * @param f_pos: File position offset (not modified in this implementation).
+ * @param iocb: The request, with the file (aesd_file in private_data) and the file position.
+ * @param from: Source of the data.
  * 
  * @return Number of bytes written, or an error code (-ENOMEM, -EFAULT, or -ERESTARTSYS).
  */
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    // Initialize variables: device pointer, temporary buffer, return value, and total size
-    struct aesd_dev *dev = filp->private_data;
-    char *new_data = NULL;
+    struct aesd_dev *dev = ((struct aesd_file *)iocb->ki_filp->private_data)->dev;
+    size_t count = iov_iter_count(from);
+    loff_t *f_pos = &iocb->ki_pos;
+    // Surviving records oldest first, replaced by the records they evict when committed
+    struct aesd_buffer_entry inline_entries[AESD_WRITE_INLINE] = {};
+    size_t inline_ends[AESD_WRITE_INLINE + 1];
+    struct aesd_buffer_entry *entries = inline_entries;
+    size_t *ends = inline_ends;
+    size_t num_ends;
+    size_t num_records = 0;
+    size_t survivors = 0;
+    size_t first;
+    size_t budget;
+    size_t tail_start = 0;
+    size_t pending = 0;
+    uint32_t removed;
+    uint32_t first_removed;
+    struct aesd_snapshot *snapshot = NULL;
+    char *data;
+    char *tail = NULL;
+    const char *newline;
     ssize_t retval = -ENOMEM;
-    size_t total_size = 0;
     size_t i;
 
     // Log write operation for debugging
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
 
-    // Log current partial write state (if any) for debugging
-    if (dev->partial_write) {
-        PDEBUG("partial_write before: size=%zu, data=%.*s", dev->partial_write_size, (int)dev->partial_write_size, dev->partial_write);
-    } else {
-        PDEBUG("partial_write before: empty");
+    if (count == 0)
+        return 0;
+
+    // Copy the data once, without the lock
+    data = kmalloc(count, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    if (!copy_from_iter_full(data, count, from)) {
+        retval = -EFAULT;
+        goto out_free;
     }
 
-    // Acquire mutex for thread-safe access to device data
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    // Count the records; only the last depth of them can survive. A concurrent resize may change the depth
+    // before the commit; the ring then evicts as usual
+    for (newline = data; (newline = memchr(newline, '\n', data + count - newline)); newline++)
+        num_records++;
+    survivors = min_t(size_t, num_records, READ_ONCE(dev->buffer.depth));
+    num_ends = survivors + 1;
+    if (num_ends > AESD_WRITE_INLINE + 1) {
+        ends = kmalloc_array(num_ends, sizeof(*ends), GFP_KERNEL);
+        entries = kcalloc(survivors, sizeof(*entries), GFP_KERNEL);
+        if (!ends || !entries)
+            goto out_free;
+    }
+
+    // Find the record ends, keeping those of the survivors
+    for (i = 0; i < num_records; i++) {
+        newline = memchr(data + tail_start, '\n', count - tail_start);
+        tail_start = newline - data + 1;
+        ends[i % num_ends] = tail_start;
+    }
 
-    // Calculate total size of existing partial write plus new user data
-    total_size = count + dev->partial_write_size;
+    // With a byte budget, the newest records that fit it survive, and always the last one
+    budget = READ_ONCE(dev->max_bytes);
+    if (budget) {
+        size_t bytes = 0;
 
-    // Allocate buffer for existing partial write plus new user data
-    new_data = kmalloc(total_size, GFP_KERNEL);
-    if (!new_data)
-        goto out;
+        for (i = 0; i < survivors; i++) {
+            size_t record = num_records - 1 - i;
+            size_t start = record ? ends[(record - 1) % num_ends] : 0;
+            size_t size = ends[record % num_ends] - start;
 
-    // Copy existing partial write (if any) to start of new_data
-    if (dev->partial_write) {
-        memcpy(new_data, dev->partial_write, dev->partial_write_size);
+            if (i > 0 && bytes + size > budget)
+                break;
+            bytes += size;
+        }
+        survivors = i;
+    }
+    first = num_records - survivors;
+
+    // Allocate the surviving records that lie entirely within the new bytes
+    for (i = 0; i < survivors; i++) {
+        size_t record = first + i;
+        size_t start, end = ends[record % num_ends];
+        struct aesd_record *copy;
+
+        if (record == 0)
+            continue;  // joined with the partial write under the lock
+        start = ends[(record - 1) % num_ends];
+        copy = aesd_record_alloc(end - start);
+        if (!copy)
+            goto out_free;
+        memcpy(copy->data, data + start, end - start);
+        entries[i].buffptr = copy->data;
+        entries[i].size = end - start;
     }
 
-    // Append new user data to new_data after partial write
-    if (copy_from_user(new_data + dev->partial_write_size, buf, count)) {
-        retval = -EFAULT;
-        goto out;
-    }
-
-    // Log combined buffer for debugging
-    PDEBUG("new_data=%.*s", (int)total_size, new_data);
-
-    // Check for a single newline to complete a command
-    for (i = 0; i < total_size; i++) {
-        if (new_data[i] == '\n') {
-            // Create new circular buffer entry for data up to and including newline
-            struct aesd_buffer_entry entry;
-            entry.size = i + 1;
-            entry.buffptr = kmalloc(entry.size, GFP_KERNEL);
-            if (!entry.buffptr) {
-                retval = -ENOMEM;
-                goto out;
-            }
-            memcpy((char *)entry.buffptr, new_data, entry.size);
-            PDEBUG("Adding entry: size=%zu, data=%.*s", entry.size, (int)entry.size, entry.buffptr);
+    // Prepare the new partial write from the bytes after the last newline, and the snapshot to publish
+    if (num_records > 0) {
+        if (tail_start < count) {
+            tail = kmemdup(data + tail_start, count - tail_start, GFP_KERNEL);
+            if (!tail)
+                goto out_free;
+        }
+        snapshot = kmalloc(AESD_SNAPSHOT_SIZE, GFP_KERNEL);
+        if (!snapshot)
+            goto out_free;
+    }
 
-            // Free oldest entry if circular buffer is full
-            if (dev->buffer.full) {
-                kfree((void *)dev->buffer.entry[dev->buffer.out_offs].buffptr);
-            }
+    // Acquire mutex for the commit step
+    if (mutex_lock_interruptible(&dev->lock)) {
+        retval = -ERESTARTSYS;
+        goto out_free;
+    }
 
-            // Add entry to circular buffer
-            aesd_circular_buffer_add_entry(&dev->buffer, &entry);
-
-            // Update partial write with any remaining data after newline
-            dev->partial_write_size = total_size - (i + 1);
-            if (dev->partial_write_size > 0) {
-                dev->partial_write = kmalloc(dev->partial_write_size, GFP_KERNEL);
-                if (!dev->partial_write) {
-                    retval = -ENOMEM;
-                    goto out;
-                }
-                memcpy(dev->partial_write, new_data + i + 1, dev->partial_write_size);
-            } else {
-                dev->partial_write = NULL;
-                dev->partial_write_size = 0;
-            }
-            // Set return value to number of bytes processed
-            retval = count;
-            goto out;
-        }
+    // No newline found; append all data to the partial write
+    if (num_records == 0) {
+        char *partial = krealloc(dev->partial_write, dev->partial_write_size + count, GFP_KERNEL);
+
+        if (!partial)
+            goto out_unlock;
+        memcpy(partial + dev->partial_write_size, data, count);
+        dev->partial_write = partial;
+        dev->partial_write_size += count;
+        retval = count;
+        goto out_unlock;
+    }
+
+    // The first record of the write completes the partial write, unless it is already pushed out again
+    if (first == 0) {
+        struct aesd_record *joined = aesd_record_alloc(dev->partial_write_size + ends[0]);
+
+        if (!joined)
+            goto out_unlock;
+        if (dev->partial_write)
+            memcpy(joined->data, dev->partial_write, dev->partial_write_size);
+        memcpy(joined->data + dev->partial_write_size, data, ends[0]);
+        entries[0].buffptr = joined->data;
+        entries[0].size = dev->partial_write_size + ends[0];
     }
 
-    // No newline found; update partial write with all data
+    // Replace the partial write with the remaining data after the last newline
     kfree(dev->partial_write);
-    dev->partial_write = kmalloc(total_size, GFP_KERNEL);
-    if (!dev->partial_write) {
-        retval = -ENOMEM;
-        goto out;
+    dev->partial_write = tail;
+    dev->partial_write_size = tail ? count - tail_start : 0;
+    tail = NULL;
+
+    for (i = 0; i < survivors; i++) {
+        struct aesd_buffer_entry evicted = {};
+
+        // Remember the oldest entry if circular buffer is full; the published snapshot still lists it
+        if (dev->buffer.full) {
+            evicted = *aesd_circular_buffer_entry_at(&dev->buffer, 0);
+            aesd_account(dev, &evicted, false);
+        }
+
+        // Add entry to circular buffer, which takes over the record reference
+        aesd_account(dev, &entries[i], true);
+        aesd_add_entry(dev, &entries[i]);
+        entries[i] = evicted;
     }
-    memcpy(dev->partial_write, new_data, total_size);
-    dev->partial_write_size = total_size;
+    removed = aesd_enforce_budget(dev, &first_removed);
+    aesd_publish(dev, snapshot);
+    aesd_put_removed(dev, first_removed, removed);
+    snapshot = NULL;
     // Set return value to number of bytes processed
     retval = count;
 
-out:
-    // Clean up temporary buffer and release mutex
-    if (new_data)
-        kfree(new_data);
-    // Log final partial write state for debugging
-    if (dev->partial_write) {
-        PDEBUG("partial_write after: size=%zu, data=%.*s", dev->partial_write_size, (int)dev->partial_write_size, dev->partial_write);
-    } else {
-        PDEBUG("partial_write after: empty");
+out_unlock:
+    // Remember the partial write size for the debug line, which is logged without the lock
+    pending = dev->partial_write_size;
+    mutex_unlock(&dev->lock);
+out_free:
+    // Evicted records, or uncommitted ones on error
+    for (i = 0; entries && i < survivors; i++) {
+        if (entries[i].buffptr)
+            aesd_record_put(aesd_record_of(&entries[i]));
     }
+    if (entries != inline_entries)
+        kfree(entries);
+    if (ends != inline_ends)
+        kfree(ends);
+    kfree(tail);
+    kfree(snapshot);
+    kfree(data);
     // Update file position by bytes written (to cooperate with llseek)
     if (retval > 0) {
+        PDEBUG("write committed %zu of %zu records, partial write %zu bytes", survivors, num_records, pending);
         *f_pos += retval;
     }
-    mutex_unlock(&dev->lock);
     return retval;
 }
 
-// Helper function to calculate total size (used in llseek)
-static loff_t aesd_buffer_total_size(struct aesd_circular_buffer *buffer) {
-    loff_t total = 0;
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
-        total += entry->size;
-    }
-    return total;
-}
-
 // Step 3
-// This provides custom seek support with locking, logging, and uses fixed_size_llseek for core logic.
-// The total size is the concatenated size of all entries in the circular buffer.
+// This provides custom seek support with logging, and uses fixed_size_llseek for core logic.
+// The total size is the concatenated size of all entries in the published circular buffer.
+// The current position is first moved to count from the oldest byte of that buffer, like the result.
 static loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
-    struct aesd_dev *dev = filp->private_data;
-    loff_t retval;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_circular_buffer *buffer;
+    uint64_t pos;
     loff_t size;
 
     PDEBUG("llseek: offset=%lld, whence=%d", offset, whence);
 
-    if (mutex_lock_interruptible(&dev->lock)) {
-        return -ERESTARTSYS;  // Return if mutex cannot be acquired (as per suggestion)
-    }
-
-    size = aesd_buffer_total_size(&dev->buffer);  // Calculate total concatenated size
-    retval = fixed_size_llseek(filp, offset, whence, size);  // Use kernel helper for seek logic with fixed size
+    rcu_read_lock();
+    buffer = &rcu_dereference(file->dev->snapshot)->buffer;
+    size = aesd_circular_buffer_size(buffer);  // Total concatenated size, kept by the buffer
+    pos = max(file->base + filp->f_pos, buffer->start_offset);
+    file->base = buffer->start_offset;
+    rcu_read_unlock();
+    filp->f_pos = min_t(uint64_t, pos - file->base, size);
 
-    mutex_unlock(&dev->lock);
-    return retval;
+    return fixed_size_llseek(filp, offset, whence, size);  // Use kernel helper for seek logic with fixed size
 }
 
 // Step 4
-// This handles the AESDCHAR_IOCSEEKTO command, copying data from user space and adjusting file offset.
+// This handles the AESDCHAR_IOCSEEKTO command, copying data from user space and adjusting file offset,
+// and AESDCHAR_IOCFOLLOW, which makes reads of this file block at the end of the data.
 static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     long retval = 0;
-    struct aesd_dev *dev = filp->private_data;
 
     PDEBUG("ioctl: cmd=0x%x, arg=0x%lx", cmd, arg);
 
@@ -299,11 +878,17 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
             if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0) {
                 retval = -EFAULT;  // Error if copy from user fails
             } else {
-                if (mutex_lock_interruptible(&dev->lock)) {
-                    return -ERESTARTSYS;  // Return if mutex cannot be acquired
-                }
                 retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);  // Adjust offset
-                mutex_unlock(&dev->lock);
+            }
+            break;
+        }
+        case AESDCHAR_IOCFOLLOW: {
+            uint32_t enable;
+            if (copy_from_user(&enable, (const void __user *)arg, sizeof(enable)) != 0) {
+                retval = -EFAULT;
+            } else {
+                struct aesd_file *file = filp->private_data;
+                WRITE_ONCE(file->follow, enable != 0);  // Only this open file blocks at the end
             }
             break;
         }
@@ -315,41 +900,311 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 }
 
 // This calculates the file position based on the write command index and offset within it.
-// It iterates to find the start of the specified command and adds the offset.
+// The start of the specified command comes from its offset in the buffer, plus the offset within it.
 // Invalid indices or offsets return -EINVAL.
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset) {
-    struct aesd_dev *dev = filp->private_data;
-    uint8_t num_entries;
-    loff_t pos = 0;
-    uint8_t index;
-    uint8_t i;
-
-    // Assume mutex is held by caller (as per suggestion)
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_snapshot *snapshot;
+    struct aesd_circular_buffer *buffer;
+    struct aesd_buffer_entry *entry;
+    uint32_t num_entries;
+    uint64_t entry_start;
+    size_t entry_size;
+    loff_t pos;
+    long retval = -EINVAL;
+
+    // Work on the published snapshot, which cannot change under us; its entries can, once it is old
+    rcu_read_lock();
+retry:
+    snapshot = rcu_dereference(dev->snapshot);
+    buffer = &snapshot->buffer;
 
     // Calculate number of valid entries
-    num_entries = dev->buffer.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED :
-        ((dev->buffer.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - dev->buffer.out_offs) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    num_entries = aesd_circular_buffer_count(buffer);
 
     if (write_cmd >= num_entries) {
-        return -EINVAL;  // Out of range command index
+        goto out;  // Out of range command index
     }
 
-    // Calculate position to start of the specified write_cmd
-    index = dev->buffer.out_offs;
-    for (i = 0; i < write_cmd; i++) {
-        pos += dev->buffer.entry[index].size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    entry = aesd_circular_buffer_entry_at(buffer, write_cmd);
+    entry_start = entry->offset;
+    entry_size = entry->size;
+    if (aesd_snapshot_stale(dev, snapshot))
+        goto retry;
 
     // Check offset within the command
-    if (write_cmd_offset >= dev->buffer.entry[index].size) {
-        return -EINVAL;  // Out of range offset within command
+    if (write_cmd_offset >= entry_size) {
+        goto out;  // Out of range offset within command
     }
 
-    pos += write_cmd_offset;
+    // Calculate position relative to the oldest entry
+    pos = entry_start - buffer->start_offset + write_cmd_offset;
+    file->base = buffer->start_offset;
     filp->f_pos = pos;  // Update file position
+    retval = 0;
 
     PDEBUG("Adjusted f_pos to %lld (cmd=%u, offset=%u)", pos, write_cmd, write_cmd_offset);
+out:
+    rcu_read_unlock();
+    return retval;
+}
+
+/*
+ * Largest ring depth accepted, bounding the storage allocated for the entries.
+ */
+#define AESDCHAR_MAX_RING_DEPTH (1u << 16)
+
+static unsigned int ring_depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+static bool aesd_device_ready;  // aesd_devices are set up, so ring_depth changes resize them; under kernel_param_lock
+
+/**
+ * @brief Sets the ring_depth parameter, resizing the live devices once they are set up.
+ *
+ * The depth applies to every device. If one of them can't be resized, those already resized are
+ * set back to the previous depth; records they evicted meanwhile are gone. Called with the parameter
+ * lock held, which the module takes to set up and tear down the devices.
+ *
+ * @param val: The new value as written to /sys/module/aesdchar/parameters/ring_depth or given to insmod.
+ * @param kp: The parameter.
+ *
+ * @return 0 on success, -EINVAL for a depth out of range, or the error of aesd_resize.
+ */
+static int aesd_set_ring_depth(const char *val, const struct kernel_param *kp)
+{
+    unsigned int depth;
+    unsigned int i;
+    int result = kstrtouint(val, 0, &depth);
+
+    if (result)
+        return result;
+    if (depth < 1 || depth > AESDCHAR_MAX_RING_DEPTH)
+        return -EINVAL;
+    if (aesd_device_ready) {
+        for (i = 0; i < minors; i++) {
+            result = aesd_resize(&aesd_devices[i], depth);
+            if (result) {
+                while (i--)
+                    aesd_resize(&aesd_devices[i], ring_depth);
+                return result;
+            }
+        }
+    }
+    ring_depth = depth;
+    return 0;
+}
+
+static const struct kernel_param_ops aesd_ring_depth_ops = {
+    .set = aesd_set_ring_depth,
+    .get = param_get_uint,
+};
+
+module_param_cb(ring_depth, &aesd_ring_depth_ops, &ring_depth, 0644);
+MODULE_PARM_DESC(ring_depth, "Number of records retained (1-65536, default 10); writable to resize the device");
+
+/**
+ * @brief Sets the byte budget of a device, evicting the oldest records that no longer fit.
+ *
+ * @param dev: The device.
+ * @param budget: Byte budget, 0 for none.
+ *
+ * @return 0 on success, -ENOMEM or -ERESTARTSYS.
+ */
+static int aesd_set_max_bytes(struct aesd_dev *dev, size_t budget)
+{
+    struct aesd_snapshot *snapshot = kmalloc(AESD_SNAPSHOT_SIZE, GFP_KERNEL);
+    uint32_t removed;
+    uint32_t first_removed;
+
+    if (!snapshot)
+        return -ENOMEM;
+    if (mutex_lock_interruptible(&dev->lock)) {
+        kfree(snapshot);
+        return -ERESTARTSYS;
+    }
+    WRITE_ONCE(dev->max_bytes, budget);
+    removed = aesd_enforce_budget(dev, &first_removed);
+    aesd_publish(dev, snapshot);
+    aesd_put_removed(dev, first_removed, removed);
+    mutex_unlock(&dev->lock);
+    return 0;
+}
+
+/*
+ * sysfs attributes of each device under /sys/class/aesdchar/<device>/: the byte budget, and the
+ * records, record bytes and memory the device currently holds. memory counts the record allocations,
+ * the partial write, the entry storage of the writers' buffer and the published snapshot, and the mmap
+ * area once mapped.
+ */
+static ssize_t max_bytes_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%zu\n", READ_ONCE(dev->max_bytes));
+}
+
+static ssize_t max_bytes_store(struct device *device, struct device_attribute *attr,
+                               const char *buf, size_t count)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    unsigned long budget;
+    int result = kstrtoul(buf, 0, &budget);
+
+    if (!result)
+        result = aesd_set_max_bytes(dev, budget);
+    return result ? result : count;
+}
+static DEVICE_ATTR_RW(max_bytes);
+
+static ssize_t records_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    uint32_t records;
+
+    mutex_lock(&dev->lock);
+    records = aesd_circular_buffer_count(&dev->buffer);
+    mutex_unlock(&dev->lock);
+    return sysfs_emit(buf, "%u\n", records);
+}
+static DEVICE_ATTR_RO(records);
+
+static ssize_t bytes_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    uint64_t bytes;
+
+    mutex_lock(&dev->lock);
+    bytes = aesd_circular_buffer_size(&dev->buffer);
+    mutex_unlock(&dev->lock);
+    return sysfs_emit(buf, "%llu\n", (unsigned long long)bytes);
+}
+static DEVICE_ATTR_RO(bytes);
+
+static ssize_t memory_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_dev *dev = dev_get_drvdata(device);
+    size_t memory;
+
+    mutex_lock(&dev->lock);
+    memory = dev->record_memory + dev->partial_write_size +
+             (dev->buffer.mask + 1) * sizeof(struct aesd_buffer_entry) + AESD_SNAPSHOT_SIZE;
+    if (dev->mirror)
+        memory += PAGE_SIZE + dev->mirror_size;
+    mutex_unlock(&dev->lock);
+    return sysfs_emit(buf, "%zu\n", memory);
+}
+static DEVICE_ATTR_RO(memory);
+
+static struct attribute *aesd_attrs[] = {
+    &dev_attr_max_bytes.attr,
+    &dev_attr_records.attr,
+    &dev_attr_bytes.attr,
+    &dev_attr_memory.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(aesd);
+
+/**
+ * @brief Allocates the mmap area of a device on first use and fills it with the retained records.
+ *
+ * @return 0 on success, -ENOMEM or -ERESTARTSYS.
+ */
+static int aesd_mirror_get(struct aesd_dev *dev)
+{
+    size_t size = roundup_pow_of_two(max_t(unsigned long, mmap_size, PAGE_SIZE));
+    struct aesd_mmap_header *header;
+    int result = 0;
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    if (!dev->mirror) {
+        header = vmalloc_user(PAGE_SIZE + size);
+        if (header) {
+            header->data_size = size;
+            dev->mirror = header;
+            dev->mirror_size = size;
+            dev->mirrored_end = 0;
+            aesd_mirror_update(dev);
+        } else {
+            result = -ENOMEM;
+        }
+    }
+    mutex_unlock(&dev->lock);
+    return result;
+}
+
+/**
+ * @brief Reports whether a read would return data without sleeping.
+ *
+ * The device is readable while data past the file position exists, counted in stream offsets so that
+ * evictions don't hide new records from a reader at the end. Writes never block.
+ *
+ * @param filp: File pointer containing the aesd_file in private_data.
+ * @param wait: Poll table to register the device wait queue with.
+ *
+ * @return The ready events.
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &file->dev->wait, wait);
+
+    if (aesd_end_offset(file->dev) > file->base + filp->f_pos)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+/**
+ * @brief Maps the device read-only: the aesd_mmap_header page, then the data area twice in a row.
+ *
+ * The mapping must start at offset 0 and may be shorter than the whole area. Pages are inserted up front,
+ * so accessing the mapping never faults into the driver.
+ *
+ * @param filp: File pointer containing the aesd_file in private_data.
+ * @param vma: The mapping to set up.
+ *
+ * @return 0 on success, -ENODEV if mmap is disabled, -EACCES for a writable mapping, -EINVAL for a bad
+ * offset or length, or the error of the allocation or page insertion.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long off;
+    int result;
+
+    PDEBUG("mmap %lu bytes", len);
+
+    if (!mmap_size)
+        return -ENODEV;
+    // Writers own the area; a writable mapping, even a private one, could make readers see other data
+    if (vma->vm_flags & VM_WRITE)
+        return -EACCES;
+    if (vma->vm_pgoff != 0)
+        return -EINVAL;
+
+    result = aesd_mirror_get(dev);
+    if (result)
+        return result;
+    if (len > PAGE_SIZE + 2 * dev->mirror_size)
+        return -EINVAL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    for (off = 0; off < len; off += PAGE_SIZE) {
+        size_t area_off = off ? PAGE_SIZE + ((off - PAGE_SIZE) & (dev->mirror_size - 1)) : 0;
+
+        result = vm_insert_page(vma, vma->vm_start + off, vmalloc_to_page((char *)dev->mirror + area_off));
+        if (result)
+            return result;
+    }
     return 0;
 }
 
@@ -358,25 +1213,34 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
  */
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
 /**
  * @brief Initializes and registers the character device with the kernel.
  * 
  * @param dev: Pointer to the aesd_dev structure containing the character device (cdev).
+ * @param index: Index of the device, added to aesd_minor and to its name.
  * 
- * @return 0 on success or a negative error code if cdev_add fails.
+ * @return 0 on success or a negative error code if cdev_add or device_create fails.
  */
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
     // Creates a device number using the major and minor numbers.
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
     
     PDEBUG("set up char device");
 
@@ -388,10 +1252,114 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
         printk(KERN_ERR "Error %d adding aesd cdev", err);
+        return err;
+    }
+    // Registers the device in sysfs with its attributes (and for udev).
+    dev->device = device_create_with_groups(aesd_class, NULL, devno, dev, aesd_groups, "aesdchar%u", index);
+    if (IS_ERR(dev->device)) {
+        err = PTR_ERR(dev->device);
+        printk(KERN_ERR "Error %d creating aesd device", err);
+        cdev_del(&dev->cdev);
     }
     return err;
 }
 
+/**
+ * @brief Destroys the record caches created so far.
+ */
+static void aesd_destroy_caches(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(aesd_record_caches); i++) {
+        kmem_cache_destroy(aesd_record_caches[i]);
+        aesd_record_caches[i] = NULL;
+    }
+}
+
+/**
+ * @brief Creates the record caches, see aesd_record_classes.
+ *
+ * @return 0 on success or -ENOMEM.
+ */
+static int aesd_create_caches(void)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(aesd_record_caches); i++) {
+        aesd_record_caches[i] = kmem_cache_create(aesd_record_classes[i].name, aesd_record_classes[i].size,
+                                                  0, 0, NULL);
+        if (!aesd_record_caches[i]) {
+            aesd_destroy_caches();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees the records, buffers and mirror of a device.
+ *
+ * @param dev: The device, no longer reachable by any file.
+ */
+static void aesd_dev_free(struct aesd_dev *dev)
+{
+    // Frees the current snapshot and drops the writers' references, releasing all records.
+    kfree(rcu_dereference_protected(dev->snapshot, 1));
+    aesd_buffer_put_records(&dev->buffer);
+    if (dev->buffer.entry != dev->buffer.inline_entry)
+        kvfree(dev->buffer.entry);
+
+    // Frees the partial write buffer to prevent memory leaks.
+    if (dev->partial_write)
+        kfree(dev->partial_write);
+    // Open files, and so mappings, hold a module reference: nothing maps the area any more.
+    vfree(dev->mirror);
+
+    // Destroys the mutex to release its resources.
+    mutex_destroy(&dev->lock);
+}
+
+/**
+ * @brief Sets up one device: its circular buffer, lock, wait queue and character device.
+ *
+ * @param dev: The zeroed device.
+ * @param index: Index of the device.
+ *
+ * @return 0 on success or a negative error code on failure.
+ */
+static int aesd_dev_init(struct aesd_dev *dev, unsigned int index)
+{
+    int result;
+
+    aesd_circular_buffer_init(&dev->buffer);
+    mutex_init(&dev->lock);
+    init_waitqueue_head(&dev->wait);
+    dev->max_bytes = max_bytes;
+
+    // Allocates the ring for ring_depth records and publishes an empty snapshot; readers always find one
+    result = aesd_resize(dev, ring_depth);
+    if (!result)
+        result = aesd_setup_cdev(dev, index);
+    if (result)
+        aesd_dev_free(dev);
+    return result;
+}
+
+/**
+ * @brief Removes one device from sysfs and the system and frees it.
+ *
+ * @param dev: The device.
+ * @param index: Index of the device.
+ */
+static void aesd_dev_destroy(struct aesd_dev *dev, unsigned int index)
+{
+    // Removes the device from sysfs and the character device from the system with cdev_del.
+    device_destroy(aesd_class, MKDEV(aesd_major, aesd_minor + index));
+    cdev_del(&dev->cdev);
+    aesd_dev_free(dev);
+}
+
 /**
  * @brief Initializes the AESD character driver module during loading.
  * 
@@ -400,30 +1368,68 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int i;
     int result;
 
     PDEBUG("%sinit module%s", BLUE, RESET);
 
-    // Allocates a dynamic major number for the device using alloc_chrdev_region.
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+    if (minors < 1 || minors > AESDCHAR_MAX_MINORS)
+        return -EINVAL;
+
+    // Allocates a dynamic major number and a minor number per device using alloc_chrdev_region.
+    result = alloc_chrdev_region(&dev, aesd_minor, minors, "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    // Initializes the aesd_device structure, including the circular buffer and mutex.
-    memset(&aesd_device, 0, sizeof(struct aesd_dev));
-
-    aesd_circular_buffer_init(&aesd_device.buffer);
-    mutex_init(&aesd_device.lock);
 
-    // Sets up the character device with aesd_setup_cdev
-    result = aesd_setup_cdev(&aesd_device);
+    // Creates the record caches and the device class for sysfs.
+    result = aesd_create_caches();
+    if (result)
+        goto out_unregister;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    aesd_class = class_create("aesdchar");
+#else
+    aesd_class = class_create(THIS_MODULE, "aesdchar");
+#endif
+    if (IS_ERR(aesd_class)) {
+        result = PTR_ERR(aesd_class);
+        goto out_caches;
+    }
 
-    // If setup fails, unregisters the device region and returns the error.
-    if (result) {
-        unregister_chrdev_region(dev, 1);
+    // Allocates the devices; each has its own records, lock and partial write.
+    aesd_devices = kcalloc(minors, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto out_class;
+    }
+    // The parameters are writable already: a ring_depth write comes before the devices read it, or resizes them
+    kernel_param_lock(THIS_MODULE);
+    for (i = 0; i < minors; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if (result)
+            break;
     }
+    aesd_device_ready = !result;
+    kernel_param_unlock(THIS_MODULE);
+    if (result)
+        goto out_devices;
+    return 0;
+
+    // If setup fails, releases what was set up and returns the error.
+out_devices:
+    while (i--)
+        aesd_dev_destroy(&aesd_devices[i], i);
+    kfree(aesd_devices);
+    // Devices set up could be written already; their records are queued for release into the caches
+    rcu_barrier();
+out_class:
+    class_destroy(aesd_class);
+out_caches:
+    aesd_destroy_caches();
+out_unregister:
+    unregister_chrdev_region(dev, minors);
     return result;
 }
 
@@ -435,29 +1441,26 @@ void aesd_cleanup_module(void)
 {
     // Creates the device number from major and minor numbers.
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
+    unsigned int i;
 
     PDEBUG("%scleanup module%s", RED, RESET);
     PDEBUG("\n");
 
-    // Removes the character device from the system with cdev_del.
-    cdev_del(&aesd_device.cdev);
+    // A ring_depth write in progress finishes first; later ones leave the devices alone
+    kernel_param_lock(THIS_MODULE);
+    aesd_device_ready = false;
+    kernel_param_unlock(THIS_MODULE);
+    for (i = 0; i < minors; i++)
+        aesd_dev_destroy(&aesd_devices[i], i);
+    kfree(aesd_devices);
 
-    // Frees all buffer entries in the circular buffer using AESD_CIRCULAR_BUFFER_FOREACH.
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        if (entry->buffptr)
-            kfree(entry->buffptr);
-    }
+    // Waits for the records queued for release: their callback is module code and frees into the caches.
+    rcu_barrier();
+    aesd_destroy_caches();
+    class_destroy(aesd_class);
 
-    // Frees the partial write buffer to prevent memory leaks.
-    if (aesd_device.partial_write)
-        kfree(aesd_device.partial_write);
-
-    // Destroys the mutex to release its resources.
-    mutex_destroy(&aesd_device.lock);
     // Unregisters the device region to free the major number.
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, minors);
 }
 
 module_init(aesd_init_module);
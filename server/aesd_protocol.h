@@ -0,0 +1,104 @@
+/*
+ * aesd_protocol.h
+ *
+ * Length-prefixed binary protocol spoken by aesdsocket next to the newline
+ * protocol. A client selects it by sending AESD_PROTO_MAGIC as the very first
+ * byte of the connection; everything after it is a sequence of frames:
+ *
+ *   byte 0     opcode (AESD_OP_*)
+ *   byte 1     requests: flags (AESD_FLAG_*), responses: status (AESD_STATUS_*)
+ *   bytes 2-3  reserved, zero
+ *   bytes 4-7  payload length, big endian
+ *   payload
+ *
+ * Every request gets exactly one response frame with the same opcode, in
+ * request order, so requests can be pipelined.
+ *
+ *   APPEND  payload is stored as-is (not scanned for newlines). The response
+ *           is empty, or carries the full contents with AESD_FLAG_REPLAY.
+ *   REPLAY  empty payload; response carries the full contents.
+ *   SEEKTO  payload is write_cmd, write_cmd_offset (2 x u32 big endian); the
+ *           response carries the contents from that position (aesdchar only).
+ *   TAIL    payload is a byte offset (u64 big endian); the response carries
+ *           the contents from that offset to the end.
+ *   GREP    payload is a pattern (see AESDCHAR_GREP); the response carries
+ *           the matching records.
+ */
+
+#ifndef AESD_PROTOCOL_H
+#define AESD_PROTOCOL_H
+
+#include <stdint.h>
+
+#define AESD_PROTO_MAGIC 0xAE
+#define AESD_FRAME_HEADER_SIZE 8
+#define AESD_FRAME_MAX_PAYLOAD (64u * 1024 * 1024)
+
+enum aesd_opcode {
+  AESD_OP_APPEND = 1,
+  AESD_OP_REPLAY = 2,
+  AESD_OP_SEEKTO = 3,
+  AESD_OP_TAIL = 4,
+  AESD_OP_GREP = 5,
+};
+
+// Request flags
+#define AESD_FLAG_REPLAY 0x01  // APPEND: reply with the full contents
+
+enum aesd_status {
+  AESD_STATUS_OK = 0,
+  AESD_STATUS_BAD_REQUEST = 1,  // unknown opcode or malformed payload
+  AESD_STATUS_UNSUPPORTED = 2,  // e.g. SEEKTO without the aesdchar device
+  AESD_STATUS_IO_ERROR = 3,     // the data file could not be accessed
+};
+
+struct aesd_frame {
+  uint8_t opcode;
+  uint8_t flags;  // status in responses
+  uint32_t length;
+};
+
+static inline void aesd_frame_encode(uint8_t* buf, uint8_t opcode,
+                                     uint8_t flags, uint32_t length) {
+  buf[0] = opcode;
+  buf[1] = flags;
+  buf[2] = 0;
+  buf[3] = 0;
+  buf[4] = length >> 24;
+  buf[5] = length >> 16;
+  buf[6] = length >> 8;
+  buf[7] = length;
+}
+
+static inline struct aesd_frame aesd_frame_decode(const uint8_t* buf) {
+  struct aesd_frame frame = {
+      .opcode = buf[0],
+      .flags = buf[1],
+      .length = (uint32_t)buf[4] << 24 | (uint32_t)buf[5] << 16 |
+                (uint32_t)buf[6] << 8 | buf[7],
+  };
+  return frame;
+}
+
+static inline uint32_t aesd_get_u32(const uint8_t* buf) {
+  return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+         (uint32_t)buf[2] << 8 | buf[3];
+}
+
+static inline void aesd_put_u32(uint8_t* buf, uint32_t value) {
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value;
+}
+
+static inline uint64_t aesd_get_u64(const uint8_t* buf) {
+  return (uint64_t)aesd_get_u32(buf) << 32 | aesd_get_u32(buf + 4);
+}
+
+static inline void aesd_put_u64(uint8_t* buf, uint64_t value) {
+  aesd_put_u32(buf, value >> 32);
+  aesd_put_u32(buf + 4, (uint32_t)value);
+}
+
+#endif /* AESD_PROTOCOL_H */
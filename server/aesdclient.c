@@ -0,0 +1,796 @@
+/**
+ * @file aesdclient.c
+ * @brief Client library for the aesdsocket protocols, see aesdclient.h
+ */
+
+#define _GNU_SOURCE  // asprintf
+
+#include "aesdclient.h"
+#include "aesd_protocol.h"
+#include "delimscan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECV_CHUNK 4096
+
+struct aesd_request {
+  struct aesd_request* next;
+  bool is_seek;
+  char* wire;        // bytes to send for this request
+  size_t wire_len;
+  size_t wire_sent;
+  size_t matched;    // bytes of wire already seen again in the reply
+  aesd_reply_cb cb;
+  void* arg;
+};
+
+struct aesd_client {
+  int fd;
+  bool failed;
+  bool binary;  // length-prefixed frames instead of the newline protocol
+  int idle_timeout_ms;
+  long long last_activity_ms;  // last progress on the seek reply at the head
+
+  // Outstanding requests in submission order; replies complete the head
+  struct aesd_request* head;
+  struct aesd_request* tail;
+  struct aesd_request* send_next;  // first request not completely sent
+  size_t outstanding;
+
+  // Received bytes not yet parsed into a complete record
+  char* in;
+  size_t in_len;
+  size_t in_cap;
+
+  // Binary mode: state of the response frame being received
+  bool in_frame;
+  uint8_t frame_status;
+  size_t frame_remaining;
+};
+
+struct aesd_client_pool {
+  char* host;
+  char* port;
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  size_t nfree;
+  // Idle connections; NULL entries are slots that still need to connect
+  struct aesd_client** free_slots;
+};
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int connect_unix(const char* path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int connect_tcp(const char* host, const char* port) {
+  struct addrinfo hints;
+  struct addrinfo* res;
+  struct addrinfo* p;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+  for (p = res; p != NULL; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (0 == connect(fd, p->ai_addr, p->ai_addrlen)) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  if (fd >= 0) {
+    // Pipelined packets are small, don't let Nagle hold them back
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+struct aesd_client* aesd_client_connect(const char* host, const char* port) {
+  struct aesd_client* client = calloc(1, sizeof(*client));
+  if (!client) {
+    return NULL;
+  }
+
+  client->fd = port ? connect_tcp(host, port) : connect_unix(host);
+  if (client->fd < 0) {
+    free(client);
+    return NULL;
+  }
+  fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+  client->idle_timeout_ms = AESD_CLIENT_DEFAULT_IDLE_TIMEOUT_MS;
+  return client;
+}
+
+struct aesd_client* aesd_client_connect_binary(const char* host,
+                                               const char* port) {
+  const uint8_t magic = AESD_PROTO_MAGIC;
+  int fd = port ? connect_tcp(host, port) : connect_unix(host);
+  if (fd < 0) {
+    return NULL;
+  }
+  // The magic byte has to be the first byte the server sees
+  if (send(fd, &magic, 1, MSG_NOSIGNAL) != 1) {
+    close(fd);
+    return NULL;
+  }
+
+  struct aesd_client* client = calloc(1, sizeof(*client));
+  if (!client) {
+    close(fd);
+    return NULL;
+  }
+  client->fd = fd;
+  client->binary = true;
+  fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK);
+  client->idle_timeout_ms = AESD_CLIENT_DEFAULT_IDLE_TIMEOUT_MS;
+  return client;
+}
+
+static void free_request(struct aesd_request* req) {
+  free(req->wire);
+  free(req);
+}
+
+// Pop the head request and report its completion
+static void complete_head(struct aesd_client* client,
+                          enum aesd_reply_event event) {
+  struct aesd_request* req = client->head;
+
+  client->head = req->next;
+  if (!client->head) {
+    client->tail = NULL;
+  }
+  if (client->send_next == req) {
+    client->send_next = req->next;
+  }
+  client->outstanding--;
+  client->last_activity_ms = now_ms();
+
+  if (req->cb) {
+    req->cb(req->arg, event, NULL, 0);
+  }
+  free_request(req);
+}
+
+// Fail every outstanding request, the connection can't be used any more
+static void fail_client(struct aesd_client* client) {
+  client->failed = true;
+  while (client->head) {
+    complete_head(client, AESD_REPLY_ERROR);
+  }
+}
+
+void aesd_client_close(struct aesd_client* client) {
+  if (!client) {
+    return;
+  }
+  fail_client(client);
+  close(client->fd);
+  free(client->in);
+  free(client);
+}
+
+void aesd_client_set_idle_timeout(struct aesd_client* client, int timeout_ms) {
+  client->idle_timeout_ms = timeout_ms;
+}
+
+// A newline-protocol seek reply has no end marker, so nothing may be sent
+// behind it until it has completed
+static bool send_blocked(const struct aesd_client* client) {
+  const struct aesd_request* req;
+  if (client->binary) {
+    return false;
+  }
+  for (req = client->head; req && req != client->send_next; req = req->next) {
+    if (req->is_seek) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Send as many queued bytes as the socket takes without blocking
+static int flush_requests(struct aesd_client* client) {
+  while (client->send_next && !send_blocked(client)) {
+    struct aesd_request* req = client->send_next;
+    ssize_t sent = send(client->fd, req->wire + req->wire_sent,
+                        req->wire_len - req->wire_sent, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (EAGAIN == errno || EWOULDBLOCK == errno) {
+        return 0;
+      }
+      return -1;
+    }
+    req->wire_sent += sent;
+    if (req->wire_sent == req->wire_len) {
+      client->send_next = req->next;
+      if (req == client->head) {
+        client->last_activity_ms = now_ms();
+      }
+    }
+  }
+  return 0;
+}
+
+static int queue_request(struct aesd_client* client, char* wire,
+                         size_t wire_len, bool is_seek, aesd_reply_cb cb,
+                         void* arg) {
+  struct aesd_request* req;
+
+  if (client->failed) {
+    free(wire);
+    errno = ENOTCONN;
+    return -1;
+  }
+  // Newline replies can only be told apart one request at a time
+  if (!client->binary && client->outstanding > 0) {
+    free(wire);
+    errno = EBUSY;
+    return -1;
+  }
+  req = calloc(1, sizeof(*req));
+  if (!req) {
+    free(wire);
+    return -1;
+  }
+  req->wire = wire;
+  req->wire_len = wire_len;
+  req->is_seek = is_seek;
+  req->cb = cb;
+  req->arg = arg;
+
+  if (client->tail) {
+    client->tail->next = req;
+  } else {
+    client->head = req;
+  }
+  client->tail = req;
+  if (!client->send_next) {
+    client->send_next = req;
+  }
+  client->outstanding++;
+
+  if (flush_requests(client) < 0) {
+    fail_client(client);
+    return -1;
+  }
+  return 0;
+}
+
+// Build a binary request frame around payload
+static char* build_frame(uint8_t opcode, uint8_t flags, const void* payload,
+                         size_t len) {
+  char* wire = malloc(AESD_FRAME_HEADER_SIZE + len);
+  if (wire) {
+    aesd_frame_encode((uint8_t*)wire, opcode, flags, len);
+    memcpy(wire + AESD_FRAME_HEADER_SIZE, payload, len);
+  }
+  return wire;
+}
+
+int aesd_client_submit(struct aesd_client* client, const char* packet,
+                       size_t len, aesd_reply_cb cb, void* arg) {
+  bool add_newline = 0 == len || packet[len - 1] != '\n';
+  size_t header = client->binary ? AESD_FRAME_HEADER_SIZE : 0;
+  size_t wire_len = header + len + add_newline;
+  char* wire;
+
+  if (client->binary && wire_len - header > AESD_FRAME_MAX_PAYLOAD) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  wire = malloc(wire_len);
+  if (!wire) {
+    return -1;
+  }
+  if (client->binary) {
+    aesd_frame_encode((uint8_t*)wire, AESD_OP_APPEND, AESD_FLAG_REPLAY,
+                      wire_len - header);
+  }
+  memcpy(wire + header, packet, len);
+  if (add_newline) {
+    wire[wire_len - 1] = '\n';
+  }
+  return queue_request(client, wire, wire_len, false, cb, arg);
+}
+
+int aesd_client_submit_seekto(struct aesd_client* client, uint32_t write_cmd,
+                              uint32_t write_cmd_offset, aesd_reply_cb cb,
+                              void* arg) {
+  char* wire = NULL;
+  int len;
+
+  if (client->binary) {
+    uint8_t payload[8];
+    aesd_put_u32(payload, write_cmd);
+    aesd_put_u32(payload + 4, write_cmd_offset);
+    len = AESD_FRAME_HEADER_SIZE + sizeof(payload);
+    wire = build_frame(AESD_OP_SEEKTO, 0, payload, sizeof(payload));
+  } else {
+    len = asprintf(&wire, "AESDCHAR_IOCSEEKTO:%u,%u\n", write_cmd,
+                   write_cmd_offset);
+  }
+  if (len < 0 || !wire) {
+    return -1;
+  }
+  return queue_request(client, wire, len, true, cb, arg);
+}
+
+int aesd_client_submit_grep(struct aesd_client* client, const char* pattern,
+                            aesd_reply_cb cb, void* arg) {
+  char* wire = NULL;
+  int len;
+
+  if (client->binary) {
+    len = AESD_FRAME_HEADER_SIZE + strlen(pattern);
+    wire = build_frame(AESD_OP_GREP, 0, pattern, strlen(pattern));
+  } else {
+    len = asprintf(&wire, "AESDCHAR_GREP:%s\n", pattern);
+  }
+  if (len < 0 || !wire) {
+    return -1;
+  }
+  // Like a seek, a newline-protocol grep reply can only end on idle
+  return queue_request(client, wire, len, true, cb, arg);
+}
+
+int aesd_client_submit_tail(struct aesd_client* client, uint64_t offset,
+                            aesd_reply_cb cb, void* arg) {
+  uint8_t payload[8];
+  char* wire;
+
+  if (!client->binary) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  aesd_put_u64(payload, offset);
+  wire = build_frame(AESD_OP_TAIL, 0, payload, sizeof(payload));
+  if (!wire) {
+    return -1;
+  }
+  return queue_request(client, wire, AESD_FRAME_HEADER_SIZE + sizeof(payload),
+                       false, cb, arg);
+}
+
+int aesd_client_submit_frame(struct aesd_client* client, uint8_t opcode,
+                             uint8_t flags, const void* payload, size_t len,
+                             aesd_reply_cb cb, void* arg) {
+  char* wire;
+
+  if (!client->binary) {
+    errno = ENOTSUP;
+    return -1;
+  }
+  if (len > AESD_FRAME_MAX_PAYLOAD) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  wire = build_frame(opcode, flags, payload, len);
+  if (!wire) {
+    return -1;
+  }
+  return queue_request(client, wire, AESD_FRAME_HEADER_SIZE + len, false, cb,
+                       arg);
+}
+
+int aesd_client_fd(const struct aesd_client* client) { return client->fd; }
+
+short aesd_client_events(const struct aesd_client* client) {
+  short events = 0;
+  if (client->failed) {
+    return 0;
+  }
+  if (client->head != client->send_next) {
+    events |= POLLIN;  // at least one request is waiting for its reply
+  }
+  if (client->send_next && !send_blocked(client)) {
+    events |= POLLOUT;
+  }
+  return events;
+}
+
+// A seek request at the head whose wire is fully sent is waiting for idle
+static bool head_is_pending_seek(const struct aesd_client* client) {
+  return !client->binary && client->head && client->head->is_seek &&
+         client->head->wire_sent == client->head->wire_len;
+}
+
+int aesd_client_timeout(const struct aesd_client* client) {
+  if (!head_is_pending_seek(client)) {
+    return -1;
+  }
+  long long left =
+      client->last_activity_ms + client->idle_timeout_ms - now_ms();
+  return left > 0 ? (int)left : 0;
+}
+
+// Hand one complete record to the head request. Packet replies end once
+// the packet itself has been seen again as whole records.
+static void dispatch_record(struct aesd_client* client, const char* rec,
+                            size_t len) {
+  struct aesd_request* req = client->head;
+
+  if (!req || req == client->send_next) {
+    return;  // nothing is waiting for a reply, drop stray data
+  }
+  if (req->cb) {
+    req->cb(req->arg, AESD_REPLY_RECORD, rec, len);
+  }
+  if (req->is_seek) {
+    client->last_activity_ms = now_ms();
+    return;
+  }
+
+  if (req->matched + len <= req->wire_len &&
+      0 == memcmp(req->wire + req->matched, rec, len)) {
+    req->matched += len;
+  } else if (len <= req->wire_len && 0 == memcmp(req->wire, rec, len)) {
+    req->matched = len;
+  } else {
+    req->matched = 0;
+  }
+  if (req->matched == req->wire_len) {
+    complete_head(client, AESD_REPLY_DONE);
+  }
+}
+
+// Binary mode: pass the payload of each response frame to the head request
+// record by record; the frame length tells exactly where the reply ends.
+static void parse_frames(struct aesd_client* client) {
+  size_t start = 0;
+
+  for (;;) {
+    if (!client->in_frame) {
+      if (client->in_len - start < AESD_FRAME_HEADER_SIZE) {
+        break;
+      }
+      struct aesd_frame frame =
+          aesd_frame_decode((const uint8_t*)client->in + start);
+      client->in_frame = true;
+      client->frame_status = frame.flags;
+      client->frame_remaining = frame.length;
+      start += AESD_FRAME_HEADER_SIZE;
+    }
+
+    size_t avail = client->in_len - start;
+    if (avail > client->frame_remaining) {
+      avail = client->frame_remaining;
+    }
+    const char* newline;
+    while ((newline = delimscan_find(client->in + start, avail, '\n'))) {
+      size_t len = newline - (client->in + start) + 1;
+      if (client->head && client->head->cb) {
+        client->head->cb(client->head->arg, AESD_REPLY_RECORD,
+                         client->in + start, len);
+      }
+      start += len;
+      avail -= len;
+      client->frame_remaining -= len;
+    }
+    if (avail > 0 && avail == client->frame_remaining) {
+      // Unterminated last record of the payload
+      if (client->head && client->head->cb) {
+        client->head->cb(client->head->arg, AESD_REPLY_RECORD,
+                         client->in + start, avail);
+      }
+      start += avail;
+      client->frame_remaining = 0;
+    }
+    if (client->frame_remaining > 0) {
+      break;  // wait for the rest of the payload
+    }
+
+    client->in_frame = false;
+    if (client->head && client->head != client->send_next) {
+      complete_head(client, AESD_STATUS_OK == client->frame_status
+                                ? AESD_REPLY_DONE
+                                : AESD_REPLY_ERROR);
+    }
+  }
+
+  if (start > 0) {
+    client->in_len -= start;
+    memmove(client->in, client->in + start, client->in_len);
+  }
+}
+
+static void parse_records(struct aesd_client* client) {
+  size_t start = 0;
+  const char* newline;
+
+  if (client->binary) {
+    parse_frames(client);
+    return;
+  }
+
+  while ((newline = delimscan_find(client->in + start, client->in_len - start,
+                                  '\n'))) {
+    size_t end = newline - client->in + 1;
+    dispatch_record(client, client->in + start, end - start);
+    start = end;
+  }
+  if (start > 0) {
+    client->in_len -= start;
+    memmove(client->in, client->in + start, client->in_len);
+  }
+}
+
+// Complete a seek reply at the head, including a trailing partial record
+static void finish_seek(struct aesd_client* client) {
+  if (client->in_len > 0) {
+    dispatch_record(client, client->in, client->in_len);
+    client->in_len = 0;
+  }
+  complete_head(client, AESD_REPLY_DONE);
+}
+
+static int receive_replies(struct aesd_client* client) {
+  for (;;) {
+    if (client->in_cap - client->in_len < RECV_CHUNK) {
+      size_t cap = client->in_cap ? client->in_cap * 2 : RECV_CHUNK * 2;
+      char* in = realloc(client->in, cap);
+      if (!in) {
+        return -1;
+      }
+      client->in = in;
+      client->in_cap = cap;
+    }
+
+    ssize_t received = recv(client->fd, client->in + client->in_len,
+                            client->in_cap - client->in_len, 0);
+    if (received < 0) {
+      return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+    }
+    if (0 == received) {
+      // Server closed the connection; that ends a seek reply too
+      if (head_is_pending_seek(client)) {
+        finish_seek(client);
+      }
+      errno = ECONNRESET;
+      return -1;
+    }
+    client->in_len += received;
+    parse_records(client);
+  }
+}
+
+int aesd_client_process(struct aesd_client* client, short revents) {
+  if (client->failed) {
+    return -1;
+  }
+  if ((revents & POLLIN) || (revents & (POLLERR | POLLHUP))) {
+    if (receive_replies(client) < 0) {
+      fail_client(client);
+      return -1;
+    }
+  }
+  if (head_is_pending_seek(client) && 0 == aesd_client_timeout(client)) {
+    finish_seek(client);
+  }
+  if (flush_requests(client) < 0) {
+    fail_client(client);
+    return -1;
+  }
+  return 0;
+}
+
+size_t aesd_client_outstanding(const struct aesd_client* client) {
+  return client->outstanding;
+}
+
+int aesd_client_drain(struct aesd_client* client) {
+  while (client->outstanding > 0) {
+    struct pollfd pfd = {.fd = client->fd, .events = aesd_client_events(client)};
+    int ready = poll(&pfd, 1, aesd_client_timeout(client));
+    if (ready < 0 && errno != EINTR) {
+      fail_client(client);
+      return -1;
+    }
+    if (aesd_client_process(client, ready > 0 ? pfd.revents : 0) < 0) {
+      return -1;
+    }
+  }
+  return client->failed ? -1 : 0;
+}
+
+// Collects a whole reply for the blocking helpers
+struct reply_collector {
+  char* data;
+  size_t len;
+  bool want_data;
+  bool failed;
+};
+
+static void collect_reply(void* arg, enum aesd_reply_event event,
+                          const char* data, size_t len) {
+  struct reply_collector* collector = arg;
+
+  if (AESD_REPLY_ERROR == event) {
+    collector->failed = true;
+  } else if (AESD_REPLY_RECORD == event && collector->want_data) {
+    char* grown = realloc(collector->data, collector->len + len);
+    if (!grown) {
+      collector->failed = true;
+      return;
+    }
+    memcpy(grown + collector->len, data, len);
+    collector->data = grown;
+    collector->len += len;
+  }
+}
+
+static int finish_blocking(struct aesd_client* client,
+                           struct reply_collector* collector, char** reply,
+                           size_t* reply_len) {
+  if (aesd_client_drain(client) < 0 || collector->failed) {
+    free(collector->data);
+    return -1;
+  }
+  if (reply) {
+    *reply = collector->data;
+    *reply_len = collector->len;
+  } else {
+    free(collector->data);
+  }
+  return 0;
+}
+
+int aesd_client_request(struct aesd_client* client, const char* packet,
+                        size_t len, char** reply, size_t* reply_len) {
+  struct reply_collector collector = {.want_data = reply != NULL};
+  if (aesd_client_submit(client, packet, len, collect_reply, &collector) < 0) {
+    return -1;
+  }
+  return finish_blocking(client, &collector, reply, reply_len);
+}
+
+int aesd_client_tail(struct aesd_client* client, uint64_t offset, char** reply,
+                     size_t* reply_len) {
+  struct reply_collector collector = {.want_data = reply != NULL};
+  if (aesd_client_submit_tail(client, offset, collect_reply, &collector) < 0) {
+    return -1;
+  }
+  return finish_blocking(client, &collector, reply, reply_len);
+}
+
+int aesd_client_grep(struct aesd_client* client, const char* pattern,
+                     char** reply, size_t* reply_len) {
+  struct reply_collector collector = {.want_data = reply != NULL};
+  if (aesd_client_submit_grep(client, pattern, collect_reply, &collector) < 0) {
+    return -1;
+  }
+  return finish_blocking(client, &collector, reply, reply_len);
+}
+
+int aesd_client_seekto(struct aesd_client* client, uint32_t write_cmd,
+                       uint32_t write_cmd_offset, char** reply,
+                       size_t* reply_len) {
+  struct reply_collector collector = {.want_data = reply != NULL};
+  if (aesd_client_submit_seekto(client, write_cmd, write_cmd_offset,
+                                collect_reply, &collector) < 0) {
+    return -1;
+  }
+  return finish_blocking(client, &collector, reply, reply_len);
+}
+
+struct aesd_client_pool* aesd_client_pool_create(const char* host,
+                                                 const char* port,
+                                                 size_t size) {
+  struct aesd_client_pool* pool = calloc(1, sizeof(*pool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->host = strdup(host);
+  pool->port = port ? strdup(port) : NULL;
+  pool->free_slots = calloc(size, sizeof(*pool->free_slots));
+  if (!pool->host || (port && !pool->port) || !pool->free_slots) {
+    free(pool->host);
+    free(pool->port);
+    free(pool->free_slots);
+    free(pool);
+    return NULL;
+  }
+  pool->nfree = size;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->available, NULL);
+  return pool;
+}
+
+void aesd_client_pool_destroy(struct aesd_client_pool* pool) {
+  size_t i;
+
+  if (!pool) {
+    return;
+  }
+  for (i = 0; i < pool->nfree; i++) {
+    aesd_client_close(pool->free_slots[i]);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->available);
+  free(pool->free_slots);
+  free(pool->host);
+  free(pool->port);
+  free(pool);
+}
+
+struct aesd_client* aesd_client_pool_get(struct aesd_client_pool* pool) {
+  struct aesd_client* client;
+
+  pthread_mutex_lock(&pool->lock);
+  while (0 == pool->nfree) {
+    pthread_cond_wait(&pool->available, &pool->lock);
+  }
+  client = pool->free_slots[--pool->nfree];
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!client) {
+    client = aesd_client_connect_binary(pool->host, pool->port);
+    if (!client) {
+      // Give the slot back so a later get can retry
+      aesd_client_pool_put(pool, NULL);
+    }
+  }
+  return client;
+}
+
+void aesd_client_pool_put(struct aesd_client_pool* pool,
+                          struct aesd_client* client) {
+  if (client && aesd_client_drain(client) < 0) {
+    aesd_client_close(client);
+    client = NULL;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->free_slots[pool->nfree++] = client;
+  pthread_cond_signal(&pool->available);
+  pthread_mutex_unlock(&pool->lock);
+}
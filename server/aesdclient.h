@@ -0,0 +1,190 @@
+/*
+ * aesdclient.h
+ *
+ * Client library for aesdsocket (TCP port 9000 or the optional AF_UNIX
+ * listener), speaking either protocol the server supports.
+ *
+ * Each packet sent to the server is a newline-terminated string; the server
+ * appends it to its data file and replies with the file contents.
+ *
+ * In the newline protocol replies are not framed, so the library treats a
+ * packet's reply as complete once the packet itself has been received back
+ * as whole records. That is only exact while this connection is the only
+ * writer and the packet isn't already in the history, so newline
+ * connections take one request at a time: submitting while a request is
+ * outstanding fails with EBUSY. Replies to AESDCHAR_IOCSEEKTO and
+ * AESDCHAR_GREP commands end when the connection has been idle for the
+ * configured timeout.
+ *
+ * Connections opened with aesd_client_connect_binary() use the
+ * length-prefixed protocol from aesd_protocol.h instead: every reply has an
+ * exact boundary, seek replies need no timeout and tail requests are
+ * available.
+ *
+ * Two API flavours share one connection object:
+ *  - blocking: aesd_client_request() / aesd_client_seekto()
+ *  - async: aesd_client_submit*() queue requests, the caller polls
+ *    aesd_client_fd() for aesd_client_events() and calls
+ *    aesd_client_process() when it is ready. On binary connections any
+ *    number of requests may be outstanding; replies are matched to them in
+ *    order.
+ */
+
+#ifndef AESDCLIENT_H
+#define AESDCLIENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_CLIENT_DEFAULT_PORT "9000"
+#define AESD_CLIENT_DEFAULT_IDLE_TIMEOUT_MS 100
+
+enum aesd_reply_event {
+  AESD_REPLY_RECORD,  // one record of the reply (including its '\n')
+  AESD_REPLY_DONE,    // the reply is complete, data is NULL
+  AESD_REPLY_ERROR,   // the connection failed before the reply completed,
+                      // or (binary protocol) the server rejected the request
+};
+
+/**
+ * Streaming reply callback, called for every record as it is parsed and once
+ * more with AESD_REPLY_DONE or AESD_REPLY_ERROR.
+ */
+typedef void (*aesd_reply_cb)(void* arg, enum aesd_reply_event event,
+                              const char* data, size_t len);
+
+struct aesd_client;
+struct aesd_client_pool;
+
+/**
+ * Connect to a server. If port is NULL, host is the path of an AF_UNIX
+ * socket, otherwise host/port are resolved with getaddrinfo().
+ * @return the connection or NULL (errno set)
+ */
+struct aesd_client* aesd_client_connect(const char* host, const char* port);
+
+/**
+ * Same as aesd_client_connect(), but negotiate the binary protocol.
+ */
+struct aesd_client* aesd_client_connect_binary(const char* host,
+                                               const char* port);
+
+/**
+ * Close the connection; outstanding requests get AESD_REPLY_ERROR.
+ */
+void aesd_client_close(struct aesd_client* client);
+
+/**
+ * Set how long a seek reply may be idle before it is considered complete.
+ */
+void aesd_client_set_idle_timeout(struct aesd_client* client, int timeout_ms);
+
+/**
+ * Queue a packet. A missing trailing '\n' is added.
+ * @return 0 on success, -1 on error (EBUSY: a newline connection already
+ *         has a request outstanding)
+ */
+int aesd_client_submit(struct aesd_client* client, const char* packet,
+                       size_t len, aesd_reply_cb cb, void* arg);
+
+/**
+ * Queue an AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset> command.
+ * @return 0 on success, -1 on error
+ */
+int aesd_client_submit_seekto(struct aesd_client* client, uint32_t write_cmd,
+                              uint32_t write_cmd_offset, aesd_reply_cb cb,
+                              void* arg);
+
+/**
+ * Queue an AESDCHAR_GREP:<pattern> command: the reply holds only the
+ * records matching pattern (a plain string or POSIX extended regex).
+ * @return 0 on success, -1 on error
+ */
+int aesd_client_submit_grep(struct aesd_client* client, const char* pattern,
+                            aesd_reply_cb cb, void* arg);
+
+/**
+ * Queue a request for the contents from byte offset to the end (binary
+ * protocol only, fails with ENOTSUP otherwise).
+ * @return 0 on success, -1 on error
+ */
+int aesd_client_submit_tail(struct aesd_client* client, uint64_t offset,
+                            aesd_reply_cb cb, void* arg);
+
+/**
+ * Queue an arbitrary request frame (binary protocol only, fails with
+ * ENOTSUP otherwise), e.g. to replay captured traffic verbatim.
+ * @return 0 on success, -1 on error
+ */
+int aesd_client_submit_frame(struct aesd_client* client, uint8_t opcode,
+                             uint8_t flags, const void* payload, size_t len,
+                             aesd_reply_cb cb, void* arg);
+
+/**
+ * File descriptor to poll and the poll events it currently needs.
+ */
+int aesd_client_fd(const struct aesd_client* client);
+short aesd_client_events(const struct aesd_client* client);
+
+/**
+ * Poll timeout hint in ms (-1 if none) for the idle rule of seek replies.
+ */
+int aesd_client_timeout(const struct aesd_client* client);
+
+/**
+ * Make progress after poll(): send queued bytes, parse replies, dispatch
+ * callbacks. Call with revents == 0 when poll timed out.
+ * @return 0 on success, -1 once the connection has failed
+ */
+int aesd_client_process(struct aesd_client* client, short revents);
+
+/**
+ * Number of requests still waiting for their reply.
+ */
+size_t aesd_client_outstanding(const struct aesd_client* client);
+
+/**
+ * Block until every outstanding request has completed.
+ * @return 0 on success, -1 if the connection failed
+ */
+int aesd_client_drain(struct aesd_client* client);
+
+/**
+ * Blocking helpers: send one packet (or seek command) and wait for its
+ * reply. If reply is not NULL it receives a malloc'd copy of the reply
+ * (caller frees) and reply_len its length.
+ * @return 0 on success, -1 on error
+ */
+int aesd_client_request(struct aesd_client* client, const char* packet,
+                        size_t len, char** reply, size_t* reply_len);
+int aesd_client_seekto(struct aesd_client* client, uint32_t write_cmd,
+                       uint32_t write_cmd_offset, char** reply,
+                       size_t* reply_len);
+int aesd_client_tail(struct aesd_client* client, uint64_t offset, char** reply,
+                     size_t* reply_len);
+int aesd_client_grep(struct aesd_client* client, const char* pattern,
+                     char** reply, size_t* reply_len);
+
+/**
+ * A fixed-size pool of binary protocol connections to one server.
+ * Connections are opened lazily and handed out to one user at a time.
+ */
+struct aesd_client_pool* aesd_client_pool_create(const char* host,
+                                                 const char* port, size_t size);
+void aesd_client_pool_destroy(struct aesd_client_pool* pool);
+
+/**
+ * Take a connection from the pool, waiting if all are in use.
+ * @return the connection or NULL if it could not be opened
+ */
+struct aesd_client* aesd_client_pool_get(struct aesd_client_pool* pool);
+
+/**
+ * Return a connection. Pending requests are drained first; connections that
+ * failed are closed and reopened on the next get.
+ */
+void aesd_client_pool_put(struct aesd_client_pool* pool,
+                          struct aesd_client* client);
+
+#endif /* AESDCLIENT_H */
@@ -0,0 +1,438 @@
+/**
+ * @file aesdreplay.c
+ * @brief Replay a traffic capture (aesdsocket --capture) against a running
+ * aesdsocket and report throughput and latency percentiles.
+ *
+ * Usage: aesdreplay [-h host] [-p port | -u socket] [-s speed] <trace>
+ *
+ * Every captured connection is opened, fed its packets and closed at the
+ * captured times scaled by speed (1 = as captured, N = N times faster,
+ * 0 = as fast as possible), all from one poll loop. Latency is measured from
+ * submitting a request until its reply is complete.
+ *
+ * Every connection is replayed over the binary protocol, whose replies have
+ * exact boundaries: newline-protocol replies can't be matched to requests
+ * once packets repeat or connections write concurrently. Captured newline
+ * packets are sent as the equivalent frames: APPEND with AESD_FLAG_REPLAY,
+ * SEEKTO or GREP. A command the server rejects counts as a request error
+ * instead of being stored like a packet.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd_protocol.h"
+#include "aesdclient.h"
+#include "capture.h"
+
+struct replay_conn {
+  uint64_t id;
+  bool binary;   // captured with the binary protocol
+  bool closing;  // captured close seen, close once replies are in
+  struct aesd_client* client;
+  size_t active_slot;  // position in active[] while open
+
+  // Submit times of outstanding requests, replies come back in order
+  double* sent;
+  size_t sent_head;
+  size_t sent_count;
+  size_t sent_cap;
+};
+
+struct replay_event {
+  uint8_t type;
+  uint8_t flags;
+  uint64_t time_ns;
+  const char* data;
+  uint32_t len;
+  struct replay_conn* conn;
+};
+
+static struct replay_conn** active = NULL;
+static size_t active_count = 0;
+
+// Results
+static double* latencies = NULL;
+static size_t latency_count = 0;
+static size_t latency_cap = 0;
+static unsigned long request_errors = 0;
+static unsigned long connect_errors = 0;
+static unsigned long long bytes_received = 0;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* grow_array(void* array, size_t* cap, size_t elem_size) {
+  size_t new_cap = *cap ? *cap * 2 : 64;
+  void* bigger = realloc(array, new_cap * elem_size);
+  if (!bigger) {
+    perror("realloc");
+    exit(1);
+  }
+  *cap = new_cap;
+  return bigger;
+}
+
+static void on_reply(void* arg, enum aesd_reply_event event, const char* data,
+                     size_t len) {
+  struct replay_conn* conn = arg;
+
+  if (AESD_REPLY_RECORD == event) {
+    bytes_received += len;
+    return;
+  }
+  if (0 == conn->sent_count) {
+    return;
+  }
+  double sent = conn->sent[conn->sent_head];
+  conn->sent_head = (conn->sent_head + 1) % conn->sent_cap;
+  conn->sent_count--;
+
+  if (AESD_REPLY_DONE == event) {
+    if (latency_count == latency_cap) {
+      latencies = grow_array(latencies, &latency_cap, sizeof(*latencies));
+    }
+    latencies[latency_count++] = now_s() - sent;
+  } else {
+    request_errors++;
+  }
+}
+
+// Remember when a request was submitted (a ring that grows when full)
+static void push_sent(struct replay_conn* conn, double when) {
+  if (conn->sent_count == conn->sent_cap) {
+    size_t old_cap = conn->sent_cap;
+    double* bigger = malloc((old_cap ? old_cap * 2 : 16) * sizeof(double));
+    if (!bigger) {
+      perror("malloc");
+      exit(1);
+    }
+    for (size_t i = 0; i < conn->sent_count; i++) {
+      bigger[i] = conn->sent[(conn->sent_head + i) % old_cap];
+    }
+    free(conn->sent);
+    conn->sent = bigger;
+    conn->sent_head = 0;
+    conn->sent_cap = old_cap ? old_cap * 2 : 16;
+  }
+  conn->sent[(conn->sent_head + conn->sent_count) % conn->sent_cap] = when;
+  conn->sent_count++;
+}
+
+static void close_conn(struct replay_conn* conn) {
+  if (!conn->client) {
+    return;
+  }
+  aesd_client_close(conn->client);  // fails anything still outstanding
+  conn->client = NULL;
+  conn->sent_count = 0;
+  active_count--;
+  active[conn->active_slot] = active[active_count];
+  active[conn->active_slot]->active_slot = conn->active_slot;
+}
+
+static void submit_packet(struct replay_conn* conn, const char* data,
+                          uint32_t len) {
+  static const char grep_cmd[] = "AESDCHAR_GREP:";
+  const size_t grep_cmd_len = sizeof(grep_cmd) - 1;
+  unsigned write_cmd, write_cmd_offset;
+  char command[64];
+  uint8_t seekto[8];
+  int consumed = 0;
+  int retval;
+
+  push_sent(conn, now_s());
+  if (conn->binary) {
+    if (len < AESD_FRAME_HEADER_SIZE) {
+      conn->sent_count--;
+      return;
+    }
+    struct aesd_frame frame = aesd_frame_decode((const uint8_t*)data);
+    retval = aesd_client_submit_frame(
+        conn->client, frame.opcode, frame.flags, data + AESD_FRAME_HEADER_SIZE,
+        len - AESD_FRAME_HEADER_SIZE, on_reply, conn);
+  } else if (len < sizeof(command) &&
+             (memcpy(command, data, len), command[len] = '\0',
+              sscanf(command, "AESDCHAR_IOCSEEKTO:%u,%u\n%n", &write_cmd,
+                     &write_cmd_offset, &consumed) == 2) &&
+             (uint32_t)consumed == len) {
+    aesd_put_u32(seekto, write_cmd);
+    aesd_put_u32(seekto + 4, write_cmd_offset);
+    retval = aesd_client_submit_frame(conn->client, AESD_OP_SEEKTO, 0, seekto,
+                                      sizeof(seekto), on_reply, conn);
+  } else if (len > grep_cmd_len && '\n' == data[len - 1] &&
+             0 == memcmp(data, grep_cmd, grep_cmd_len)) {
+    retval = aesd_client_submit_frame(conn->client, AESD_OP_GREP, 0,
+                                      data + grep_cmd_len,
+                                      len - grep_cmd_len - 1, on_reply, conn);
+  } else {
+    // The newline server stores the packet as-is and replies the contents
+    retval = aesd_client_submit_frame(conn->client, AESD_OP_APPEND,
+                                      AESD_FLAG_REPLAY, data, len, on_reply,
+                                      conn);
+  }
+  if (retval < 0) {
+    request_errors++;
+    close_conn(conn);
+  }
+}
+
+static void dispatch(struct replay_event* event, const char* host,
+                     const char* port) {
+  struct replay_conn* conn = event->conn;
+
+  switch (event->type) {
+    case CAPTURE_OPEN:
+      conn->binary = event->flags & CAPTURE_FLAG_BINARY;
+      conn->client = aesd_client_connect_binary(host, port);
+      if (!conn->client) {
+        connect_errors++;
+        return;
+      }
+      conn->active_slot = active_count;
+      active[active_count++] = conn;
+      break;
+    case CAPTURE_PACKET:
+      if (conn->client) {
+        submit_packet(conn, event->data, event->len);
+      }
+      break;
+    case CAPTURE_CLOSE:
+      conn->closing = true;
+      if (conn->client && 0 == aesd_client_outstanding(conn->client)) {
+        close_conn(conn);
+      }
+      break;
+  }
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static int compare_conn_id(const void* a, const void* b) {
+  uint64_t x = ((const struct replay_conn*)a)->id;
+  uint64_t y = ((const struct replay_conn*)b)->id;
+  return x < y ? -1 : x > y;
+}
+
+// Parse the whole trace, which is kept in memory for the replay
+static struct replay_event* load_trace(const char* path, char** buffer,
+                                       size_t* event_count,
+                                       struct replay_conn** conns,
+                                       size_t* conn_count) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  *buffer = malloc(size > 0 ? size : 1);
+  if (!*buffer || fread(*buffer, 1, size, file) != (size_t)size ||
+      size < CAPTURE_FILE_HEADER_SIZE ||
+      memcmp(*buffer, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    fclose(file);
+    return NULL;
+  }
+  fclose(file);
+
+  struct replay_event* events = NULL;
+  size_t events_cap = 0;
+  size_t conns_cap = 0;
+  size_t pos = CAPTURE_FILE_HEADER_SIZE;
+  *event_count = 0;
+  *conn_count = 0;
+  *conns = NULL;
+  while ((size_t)size - pos >= CAPTURE_EVENT_HEADER_SIZE) {
+    const uint8_t* header = (const uint8_t*)*buffer + pos;
+    uint32_t len = aesd_get_u32(header + 4);
+    if ((size_t)size - pos - CAPTURE_EVENT_HEADER_SIZE < len) {
+      fprintf(stderr, "%s: truncated at offset %zu\n", path, pos);
+      break;
+    }
+    if (*event_count == events_cap) {
+      events = grow_array(events, &events_cap, sizeof(*events));
+    }
+    struct replay_event* event = &events[(*event_count)++];
+    event->type = header[0];
+    event->flags = header[1];
+    event->time_ns = aesd_get_u64(header + 16);
+    event->data = *buffer + pos + CAPTURE_EVENT_HEADER_SIZE;
+    event->len = len;
+    // Stash the connection id until the connection table is built
+    event->conn = (struct replay_conn*)(uintptr_t)aesd_get_u64(header + 8);
+    if (CAPTURE_OPEN == event->type) {
+      if (*conn_count == conns_cap) {
+        *conns = grow_array(*conns, &conns_cap, sizeof(**conns));
+      }
+      memset(&(*conns)[*conn_count], 0, sizeof(**conns));
+      (*conns)[(*conn_count)++].id = aesd_get_u64(header + 8);
+    }
+    pos += CAPTURE_EVENT_HEADER_SIZE + len;
+  }
+
+  // Resolve connection ids; events of unknown connections are dropped
+  qsort(*conns, *conn_count, sizeof(**conns), compare_conn_id);
+  size_t kept = 0;
+  for (size_t i = 0; i < *event_count; i++) {
+    struct replay_conn key = {.id = (uint64_t)(uintptr_t)events[i].conn};
+    events[i].conn =
+        bsearch(&key, *conns, *conn_count, sizeof(**conns), compare_conn_id);
+    if (events[i].conn) {
+      events[kept++] = events[i];
+    }
+  }
+  *event_count = kept;
+  return events;
+}
+
+static double percentile(double p) {
+  size_t index = (size_t)(p / 100 * (latency_count - 1) + 0.5);
+  return latencies[index] * 1e3;
+}
+
+int main(int argc, char* argv[]) {
+  const char* host = "localhost";
+  const char* port = AESD_CLIENT_DEFAULT_PORT;
+  double speed = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "h:p:u:s:")) != -1) {
+    switch (opt) {
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 'u':
+        host = optarg;
+        port = NULL;
+        break;
+      case 's':
+        speed = atof(optarg);
+        break;
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind != argc - 1 || speed < 0) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-p port | -u socket] [-s speed] <trace>\n"
+            "  speed: 1 = as captured (default), N = N times faster, "
+            "0 = maximum\n",
+            argv[0]);
+    return 1;
+  }
+
+  char* buffer = NULL;
+  struct replay_conn* conns;
+  size_t event_count, conn_count;
+  struct replay_event* events =
+      load_trace(argv[optind], &buffer, &event_count, &conns, &conn_count);
+  if (!events) {
+    return 1;
+  }
+  active = calloc(conn_count + 1, sizeof(*active));
+  struct pollfd* pfds = calloc(conn_count + 1, sizeof(*pfds));
+  if (!active || !pfds) {
+    perror("calloc");
+    return 1;
+  }
+
+  size_t packets = 0;
+  for (size_t i = 0; i < event_count; i++) {
+    packets += CAPTURE_PACKET == events[i].type;
+  }
+  printf("trace: %zu connections, %zu packets over %.3f s\n", conn_count,
+         packets,
+         event_count ? events[event_count - 1].time_ns / 1e9 : 0.0);
+
+  double start = now_s();
+  size_t next = 0;
+  while (next < event_count || active_count > 0) {
+    double now = now_s();
+    while (next < event_count &&
+           (0 == speed ||
+            start + events[next].time_ns / 1e9 / speed <= now)) {
+      dispatch(&events[next++], host, port);
+    }
+    if (next == event_count && 0 == active_count) {
+      break;  // the last event closed the last connection
+    }
+
+    int timeout = -1;
+    if (next < event_count) {
+      double due = start + events[next].time_ns / 1e9 / speed - now_s();
+      timeout = due > 0 ? (int)(due * 1e3) + 1 : 0;
+    }
+    for (size_t i = 0; i < active_count; i++) {
+      int client_timeout = aesd_client_timeout(active[i]->client);
+      if (client_timeout >= 0 && (timeout < 0 || client_timeout < timeout)) {
+        timeout = client_timeout;
+      }
+      pfds[i].fd = aesd_client_fd(active[i]->client);
+      pfds[i].events = aesd_client_events(active[i]->client);
+      pfds[i].revents = 0;
+    }
+    if (poll(pfds, active_count, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    // close_conn() reorders active[], so walk a snapshot from the end
+    for (size_t i = active_count; i-- > 0;) {
+      struct replay_conn* conn = active[i];
+      if (aesd_client_process(conn->client, pfds[i].revents) < 0) {
+        close_conn(conn);
+      } else if (conn->closing && 0 == aesd_client_outstanding(conn->client)) {
+        close_conn(conn);
+      }
+    }
+  }
+  double elapsed = now_s() - start;
+
+  if (0 == speed) {
+    printf("replayed %zu requests in %.3f s at maximum speed\n",
+           latency_count + request_errors, elapsed);
+  } else {
+    printf("replayed %zu requests in %.3f s at %gx\n",
+           latency_count + request_errors, elapsed, speed);
+  }
+  printf("throughput: %.0f requests/s, %.2f MB/s received\n",
+         latency_count / elapsed, bytes_received / elapsed / 1e6);
+  if (latency_count > 0) {
+    qsort(latencies, latency_count, sizeof(*latencies), compare_double);
+    printf("latency ms: min %.3f p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f "
+           "max %.3f\n",
+           latencies[0] * 1e3, percentile(50), percentile(90), percentile(99),
+           percentile(99.9), latencies[latency_count - 1] * 1e3);
+  }
+  printf("errors: %lu requests, %lu connects\n", request_errors,
+         connect_errors);
+
+  for (size_t i = 0; i < conn_count; i++) {
+    free(conns[i].sent);
+  }
+  free(conns);
+  free(events);
+  free(buffer);
+  free(active);
+  free(pfds);
+  free(latencies);
+  return request_errors || connect_errors ? 1 : 0;
+}
@@ -1,21 +1,42 @@
+#define _GNU_SOURCE  // struct ucred for SO_PEERCRED
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <syslog.h>
 #include <unistd.h>
 
-#include "queue.h"
 #include "aesd_ioctl.h"
+#include "aesd_protocol.h"
+#include "affinity.h"
+#include "arena.h"
+#include "capture.h"
+#include "delimscan.h"
+#include "durability.h"
+#include "fair_lock.h"
+#include "grep.h"
+#include "probes.h"
+#include "ratelimit.h"
+#include "records.h"
+#include "registry.h"
+#include "storage.h"
 
 #ifdef USE_AESD_CHAR_DEVICE
 #define FILE_PATH "/dev/aesdchar"
@@ -25,6 +46,12 @@
 #define PORT "9000"
 #define BACKLOG 10
 #define BUFFER_SIZE 1024
+// Largest chunk handed to sendfile() per call when replaying the data file
+#define SENDFILE_CHUNK (64 * 1024)
+// Matching ranges handed to one sendmsg() by AESDCHAR_GREP
+#define GREP_IOV_BATCH 64
+// Newline offsets located per delimscan_index() call when framing packets
+#define TEXT_NEWLINE_BATCH 64
 
 #define ERROR_CODE -1
 
@@ -34,23 +61,59 @@ const char* NC = "\033[0m";  // No Color
 
 // Global variables
 int server_socket = -1;
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Optional AF_UNIX listener for co-located clients (enabled with -u <path>)
+int unix_socket = -1;
+char unix_socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+// Only accept AF_UNIX peers with this uid (SO_PEERCRED), -1 accepts everyone
+long unix_allowed_uid = -1;
+// Incremented by a storage operation every time data is appended to
+// FILE_PATH; only storage operations access the file (see storage.h)
+atomic_ulong data_generation = 0;
+
+// Full contents of FILE_PATH as of a given data generation. Clients that
+// finish packets at the same time share one buffer instead of each reading
+// the whole file; the last reference frees it.
+struct replay_buffer {
+  unsigned long generation;
+  int refcount;  // protected by replay_mutex
+  size_t size;
+  char data[];
+};
+
+// Registry id of the most recently accepted connection, UINT64_MAX before
+// the first, for the accept_wait tracepoint
+uint64_t last_conn_id = UINT64_MAX;
+
+// Set by SIGUSR1, the accept loop then logs server statistics
+volatile sig_atomic_t stats_requested = 0;
+// Set by SIGINT/SIGTERM, the accept loop then shuts the server down
+volatile sig_atomic_t shutdown_signal = 0;
+
+// Most recently built replay buffer, protected by replay_mutex
+struct fair_lock replay_mutex = FAIR_LOCK_INITIALIZER;
+struct replay_buffer* replay_cache = NULL;
 #ifndef USE_AESD_CHAR_DEVICE
 // Thread for writing timestamp (only used when not using aesdchar)
 pthread_t timestamp_thread;
 #endif
 
-// Thread structure using FreeBSD SLIST (Singly Linked List)
+// Per-connection state, allocated from the connection registry. The
+// connection's thread is detached and unregisters it when it finishes.
 struct client_thread {
   pthread_t thread_id;
+  uint64_t conn_id;  // registry id, also used by the tracepoints
   int client_socket;
-  bool complete;
-  SLIST_ENTRY(client_thread) entries;
+  unsigned long packets;              // requests handled, for statistics
+  struct rate_limit limit;            // per-connection packets/s and bytes/s
+  struct ratelimit_source* source;    // shared by the peer's connections
+  struct arena arena;                 // receive buffer and reply scratch
 };
 
-// Declare a singly linked list head with static initialization
-SLIST_HEAD(thread_list, client_thread)
-thread_head = SLIST_HEAD_INITIALIZER(thread_head);
+// Wake a connection thread blocked in recv() so that it exits
+void shutdown_connection(void* object, void* arg) {
+  struct client_thread* client = object;
+  shutdown(client->client_socket, SHUT_RDWR);
+}
 
 void cleanup_and_exit(int signo) {
   // Log signal received
@@ -59,21 +122,17 @@ void cleanup_and_exit(int signo) {
   syslog(LOG_INFO, "Caught signal %s, exiting...", signal_name);
   syslog(LOG_INFO, "Caught signal, exiting");
 
-  // Request threads to terminate before pthread_join()
+  // Request threads to terminate, then wait for all of them to unregister
   // Why? Some threads might still be blocked in recv() and won’t exit properly.
-  struct client_thread* thread_ptr;
-  SLIST_FOREACH(thread_ptr, &thread_head, entries) {
-    shutdown(thread_ptr->client_socket, SHUT_RDWR);  // Stop communication
-    close(thread_ptr->client_socket);
-  }
+  // Throttled threads sleep instead, so wake them too.
+  ratelimit_shutdown();
+  registry_foreach(shutdown_connection, NULL);
+  registry_wait_empty();
+  registry_destroy();
+  capture_close();
 
-  // Join all threads
-  while (!SLIST_EMPTY(&thread_head)) {
-    thread_ptr = SLIST_FIRST(&thread_head);
-    pthread_join(thread_ptr->thread_id, NULL);
-    SLIST_REMOVE_HEAD(&thread_head, entries);
-    free(thread_ptr);
-  }
+  // Flush anything still pending and stop the syncer thread
+  durability_stop();
 
 #ifndef USE_AESD_CHAR_DEVICE
   // Cancel and join timestamp thread
@@ -82,19 +141,39 @@ void cleanup_and_exit(int signo) {
   pthread_join(timestamp_thread, NULL);
 #endif
 
+  // Nothing submits storage operations any more
+  storage_stop();
+
   // Close server socket if open
   if (server_socket >= 0) {
     shutdown(server_socket, SHUT_RDWR);  // Disable further send/receive
     close(server_socket);
   }
 
+  // Close the AF_UNIX listener and remove its socket file
+  if (unix_socket >= 0) {
+    close(unix_socket);
+    unlink(unix_socket_path);
+  }
+
 #ifndef USE_AESD_CHAR_DEVICE
-  // Only remove the file if not using the character device
-  remove(FILE_PATH);
+  // Only remove the file if not using the character device. A record file
+  // keeps its history across restarts.
+  if (records_enabled()) {
+    records_close();
+  } else {
+    remove(FILE_PATH);
+  }
 #endif
 
+  // Drop the cached replay buffer
+  if (replay_cache) {
+    free(replay_cache);
+    replay_cache = NULL;
+  }
+
   // Destroy mutex
-  pthread_mutex_destroy(&file_mutex);
+  fair_lock_destroy(&replay_mutex);
 
   // Close syslog
   syslog(LOG_INFO, "Server exits cleanly");
@@ -103,9 +182,63 @@ void cleanup_and_exit(int signo) {
   exit(0);
 }
 
+// Write data to FILE_PATH, framed as a record in --records mode. Must be
+// called from a storage operation. Returns -1 if the file could not be
+// opened.
+int write_data(const char* data, size_t len) {
+#ifndef USE_AESD_CHAR_DEVICE
+  if (records_enabled()) {
+    return records_append(data, len);
+  }
+#endif
+
+  // Open the file for writing
+#ifdef USE_AESD_CHAR_DEVICE
+  FILE* file_ptr = fopen(FILE_PATH, "r+");  // r+ for character device
+#else
+  FILE* file_ptr = fopen(FILE_PATH, "a+");  // a+ for regular file
+#endif
+  if (!file_ptr) {
+    syslog(LOG_ERR, "Failed to open file for writing: %s", strerror(errno));
+    return ERROR_CODE;
+  }
+
+  size_t bytes_written = fwrite(data, 1, len, file_ptr);
+  if (bytes_written != len) {
+      syslog(LOG_ERR, "Failed to write all data to file: wrote %zu/%zu bytes", bytes_written, len);
+  }
+  fflush(file_ptr);  // Ensure data is flushed to the device/file
+  fclose(file_ptr);
+  return 0;
+}
+
+// Storage operation appending one packet
+struct append_op {
+  uint64_t conn_id;
+  const char* data;
+  size_t len;
+  unsigned long sync_ticket;  // results
+  unsigned long generation;   // 0 on failure
+};
+
+void append_op_run(void* arg) {
+  struct append_op* op = arg;
+
+  AESD_PROBE1(lock_acquired, op->conn_id);
+  AESD_PROBE2(write_start, op->conn_id, op->len);
+  if (write_data(op->data, op->len) < 0) {
+    op->generation = 0;
+    return;
+  }
+  AESD_PROBE2(write_done, op->conn_id, op->len);
+  op->sync_ticket = durability_after_append();
+  op->generation = ++data_generation;
+}
+
 #ifndef USE_AESD_CHAR_DEVICE
 // Function to write timestamp every 10 seconds
 void* timestamp_writer(void* arg) {
+  affinity_apply(AFFINITY_TIMESTAMP);
   while (1) {
     sleep(10);
 
@@ -114,143 +247,609 @@ void* timestamp_writer(void* arg) {
     char timestamp[BUFFER_SIZE];
     strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", t);
 
-    pthread_mutex_lock(&file_mutex);
-    FILE* file_ptr = fopen(FILE_PATH, "a");
-    if (file_ptr) {
-      fputs(timestamp, file_ptr);
-      fclose(file_ptr);
-    } else {
-      syslog(LOG_ERR, "Failed to open file for timestamp: %s", strerror(errno));
-    }
-    pthread_mutex_unlock(&file_mutex);
+    // The storage thread completes the operation on this stack, so it must
+    // not be cancelled halfway. UINT64_MAX is no connection's id, so its
+    // probes don't mix with those of a connection
+    struct append_op op = {
+        .conn_id = UINT64_MAX, .data = timestamp, .len = strlen(timestamp)};
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    storage_run(append_op_run, &op);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
   }
   return NULL;
 }
 #endif
 
-void* handle_client_connection(void* arg) {
-  struct client_thread* client = (struct client_thread*)arg;
+// Send up to limit bytes from the current position of fd to the client.
+// sendfile() moves the data kernel-side without a userspace copy; files
+// that don't support it (e.g. a char device without splice) fall back to a
+// plain read/send loop. Must be called from a storage operation.
+// Returns the number of bytes sent, or -1 on error.
+ssize_t send_file_contents(int client_socket, int fd, size_t limit) {
+  size_t total = 0;
+  ssize_t bytes_sent;
+
+  while (total < limit &&
+         (bytes_sent = sendfile(client_socket, fd, NULL,
+                                limit - total < SENDFILE_CHUNK
+                                    ? limit - total
+                                    : SENDFILE_CHUNK)) > 0) {
+    total += bytes_sent;
+  }
+  if (total == limit || 0 == bytes_sent) {
+    return total;  // done or EOF reached
+  }
+  if (total > 0 || (errno != EINVAL && errno != ENOSYS)) {
+    syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
+    return ERROR_CODE;
+  }
+
   char buffer[BUFFER_SIZE];
-  FILE* file_ptr = NULL;
-  char* data = NULL;  // Pointer for dynamically allocated memory
-  size_t total_data_size = 0;
-  ssize_t bytes_received;
-  syslog(LOG_INFO, "Thread [%lu] handling client socket [%d]",
-         client->thread_id, client->client_socket);
+  ssize_t bytes_read;
+  while (total < limit &&
+         (bytes_read = read(fd, buffer,
+                            limit - total < BUFFER_SIZE ? limit - total
+                                                        : BUFFER_SIZE)) > 0) {
+    if (send(client_socket, buffer, bytes_read, MSG_NOSIGNAL) != bytes_read) {
+      syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
+      return ERROR_CODE;
+    }
+    total += bytes_read;
+  }
+  return total;
+}
 
-  // Receive data from the client
-  while ((bytes_received =
-              recv(client->client_socket, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-    buffer[bytes_received] = '\0';  // Null-terminate the received data
+// Storage operation reading the whole of FILE_PATH into a new replay buffer
+// with refcount 1, or NULL on failure.
+void replay_read_file(void* arg) {
+  struct replay_buffer** result = arg;
+  struct replay_buffer* replay;
+  size_t capacity = BUFFER_SIZE;
+  struct stat st;
+  ssize_t bytes_read;
+
+  *result = NULL;
+  int fd = open(FILE_PATH, O_RDONLY);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to open file for reading: %s", strerror(errno));
+    return;
+  }
+  // Regular files report their size up front, the char device does not
+  if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+    capacity = st.st_size;
+  }
 
-    // Allocate/reallocate memory for the data
-    char* new_data = realloc(data, total_data_size + bytes_received + 1);
-    if (!new_data) {
-      syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
-      if (data) {
-        free(data);
-      }
-      if (file_ptr) {
-        pthread_mutex_lock(&file_mutex);
-        fclose(file_ptr);
-        pthread_mutex_unlock(&file_mutex);
+  replay = malloc(sizeof(*replay) + capacity);
+  if (!replay) {
+    syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
+    close(fd);
+    return;
+  }
+  replay->generation = data_generation;
+  replay->refcount = 1;
+  replay->size = 0;
+
+  while ((bytes_read = read(fd, replay->data + replay->size,
+                            capacity - replay->size)) > 0) {
+    replay->size += bytes_read;
+    if (replay->size == capacity) {
+      struct replay_buffer* bigger =
+          realloc(replay, sizeof(*replay) + capacity * 2);
+      if (!bigger) {
+        syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
+        break;
       }
+      replay = bigger;
+      capacity *= 2;
+    }
+  }
+  if (bytes_read < 0) {
+    syslog(LOG_ERR, "Failed to read file: %s", strerror(errno));
+  }
+  close(fd);
+  if (records_enabled()) {
+    // Clients see the payloads only
+    replay->size = records_strip(replay->data, replay->size);
+  }
+  *result = replay;
+}
+
+// Get a reference to the file contents as of at least generation. If the
+// cached buffer is older, the file is read once more while other requesters
+// wait on replay_mutex, so a burst of replays costs a single read.
+struct replay_buffer* replay_acquire(unsigned long generation) {
+  struct replay_buffer* replay;
+
+  fair_lock_acquire(&replay_mutex);
+  if (!replay_cache || replay_cache->generation < generation) {
+    storage_run(replay_read_file, &replay);
+    if (!replay) {
+      fair_lock_release(&replay_mutex);
       return NULL;
     }
-    data = new_data;
+    // Replace the cache; the old buffer lives on while others still send it
+    if (replay_cache && --replay_cache->refcount == 0) {
+      free(replay_cache);
+    }
+    replay_cache = replay;
+  }
+  replay = replay_cache;
+  replay->refcount++;
+  fair_lock_release(&replay_mutex);
+  return replay;
+}
 
-    // Copy the received data into the allocated memory
-    memcpy(data + total_data_size, buffer, bytes_received);
-    total_data_size += bytes_received;
-    data[total_data_size] = '\0';  // Null-terminate the combined data
+// Drop a reference taken with replay_acquire()
+void replay_release(struct replay_buffer* replay) {
+  fair_lock_acquire(&replay_mutex);
+  if (--replay->refcount == 0) {
+    free(replay);
+  }
+  fair_lock_release(&replay_mutex);
+}
+
+// Current data generation
+unsigned long current_generation(void) { return data_generation; }
+
+// Append data to the data file as-is and wait for the configured durability.
+// Returns the data generation that includes it, or 0 on failure, including
+// a failed sync in packet or ack mode.
+unsigned long append_to_file(struct client_thread* client, const char* data,
+                             size_t total_data_size) {
+  struct append_op op = {
+      .conn_id = client->conn_id, .data = data, .len = total_data_size};
+
+  // Write the packet to the file
+  AESD_PROBE2(lock_wait, client->conn_id, total_data_size);
+  storage_run(append_op_run, &op);
+  if (0 == op.generation) {
+    return 0;
+  }
+
+  // In ack mode the reply doubles as the durability acknowledgement
+  AESD_PROBE2(sync_wait_start, client->conn_id, op.sync_ticket);
+  int synced = durability_wait(op.sync_ticket);
+  AESD_PROBE2(sync_wait_done, client->conn_id, op.sync_ticket);
+  if (synced < 0) {
+    // Not durable: the caller reports an error instead of the ack
+    syslog(LOG_ERR, "Packet from connection %llu was not synced",
+           (unsigned long long)client->conn_id);
+    return 0;
+  }
+  return op.generation;
+}
+
+// Send a binary protocol response header announcing len payload bytes,
+// followed by the payload from data. With data NULL only the header is sent
+// and the caller streams the payload. Returns -1 on error.
+int send_frame(struct client_thread* client, uint8_t opcode, uint8_t status,
+               const char* data, size_t len) {
+  uint8_t header[AESD_FRAME_HEADER_SIZE];
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = sizeof(header)},
+      {.iov_base = (void*)data, .iov_len = data ? len : 0},
+  };
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+
+  aesd_frame_encode(header, opcode, status, len);
+  if (sendmsg(client->client_socket, &msg, MSG_NOSIGNAL) !=
+      (ssize_t)(sizeof(header) + iov[1].iov_len)) {
+    syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
+    return ERROR_CODE;
+  }
+  return 0;
+}
+
+// Send the contents from byte offset on, as of at least generation. The
+// replay buffer is shared with any other client replaying the same (or a
+// newer) generation. With a non-zero opcode the reply is a binary frame.
+int send_replay(struct client_thread* client, unsigned long generation,
+                uint64_t offset, uint8_t opcode) {
+  int retval = 0;
+
+  AESD_PROBE2(replay_start, client->conn_id, generation);
+  struct replay_buffer* replay = replay_acquire(generation);
+  if (!replay) {
+    return opcode ? send_frame(client, opcode, AESD_STATUS_IO_ERROR, NULL, 0)
+                  : 0;
+  }
+  AESD_PROBE3(replay_done, client->conn_id, replay->generation, replay->size);
+
+  size_t start = offset < replay->size ? offset : replay->size;
+  size_t len = replay->size - start;
+  AESD_PROBE2(send_start, client->conn_id, len);
+  if (opcode) {
+    retval = send_frame(client, opcode, AESD_STATUS_OK, replay->data + start,
+                        len);
+  } else if (send(client->client_socket, replay->data + start, len,
+                  MSG_NOSIGNAL) != (ssize_t)len) {
+    syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
+  }
+  AESD_PROBE2(send_done, client->conn_id, len);
+  replay_release(replay);
+  return retval;
+}
+
+// Send the records of the contents that match pattern. The contents come
+// from the shared replay buffer; matching records are sent straight out of
+// it, adjacent ones as a single range. With a non-zero opcode the reply is
+// a binary frame. Returns -1 on error.
+int send_grep(struct client_thread* client, const char* pattern,
+              size_t pattern_len, uint8_t opcode) {
+  struct grep_matcher matcher;
+  struct iovec* ranges = NULL;
+  size_t range_count = 0, range_capacity = 0;
+  size_t total = 0;
+  int retval = 0;
+
+  if (grep_compile(&matcher, pattern, pattern_len) < 0) {
+    return opcode ? send_frame(client, opcode, AESD_STATUS_BAD_REQUEST, NULL, 0)
+                  : 0;
+  }
+  struct replay_buffer* replay = replay_acquire(current_generation());
+  if (!replay) {
+    grep_free(&matcher);
+    return opcode ? send_frame(client, opcode, AESD_STATUS_IO_ERROR, NULL, 0)
+                  : 0;
+  }
+
+  // Collect the matching ranges first: a frame needs its length up front
+  size_t pos = 0;
+  while (pos < replay->size) {
+    const char* line = replay->data + pos;
+    const char* newline = delimscan_find(line, replay->size - pos, '\n');
+    size_t len = newline ? (size_t)(newline - line) + 1 : replay->size - pos;
+    if (grep_match(&matcher, line, len)) {
+      if (range_count > 0 &&
+          (char*)ranges[range_count - 1].iov_base +
+                  ranges[range_count - 1].iov_len == line) {
+        ranges[range_count - 1].iov_len += len;
+      } else {
+        if (range_count == range_capacity) {
+          // Scratch memory, dropped with the rest when the packet is done
+          range_capacity = range_capacity ? range_capacity * 2 : 16;
+          struct iovec* bigger =
+              arena_alloc(&client->arena, range_capacity * sizeof(*ranges));
+          if (!bigger) {
+            syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
+            retval = ERROR_CODE;
+            goto out;
+          }
+          if (ranges) {
+            memcpy(bigger, ranges, range_count * sizeof(*ranges));
+          }
+          ranges = bigger;
+        }
+        ranges[range_count].iov_base = (void*)line;
+        ranges[range_count].iov_len = len;
+        range_count++;
+      }
+      total += len;
+    }
+    pos += len;
+  }
 
-    // If a newline is detected in the buffer, process the accumulated data
-    if (strchr(buffer, '\n') != NULL) {
-      bool is_seek_cmd = false;
+  if (opcode && send_frame(client, opcode, AESD_STATUS_OK, NULL, total) < 0) {
+    retval = ERROR_CODE;
+    goto out;
+  }
+  for (size_t i = 0; i < range_count; i += GREP_IOV_BATCH) {
+    size_t batch =
+        range_count - i < GREP_IOV_BATCH ? range_count - i : GREP_IOV_BATCH;
+    size_t batch_bytes = 0;
+    for (size_t j = i; j < i + batch; j++) {
+      batch_bytes += ranges[j].iov_len;
+    }
+    // sendmsg() on a blocking socket only returns short on error
+    struct msghdr msg = {.msg_iov = ranges + i, .msg_iovlen = batch};
+    if (sendmsg(client->client_socket, &msg, MSG_NOSIGNAL) !=
+        (ssize_t)batch_bytes) {
+      syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
+      retval = ERROR_CODE;
+      break;
+    }
+  }
 
-      pthread_mutex_lock(&file_mutex);
+out:
+  replay_release(replay);
+  grep_free(&matcher);
+  return retval;
+}
 
-      // Open the file for reading and writing
 #ifdef USE_AESD_CHAR_DEVICE
-      file_ptr = fopen(FILE_PATH, "r+");  // r+ for character device
-#else
-      file_ptr = fopen(FILE_PATH, "a+");  // a+ for regular file
+// Storage operation for a seek command, see send_seek_reply()
+struct seek_op {
+  struct client_thread* client;
+  struct aesd_seekto seekto;
+  uint8_t opcode;
+  int retval;
+};
+
+// The reply is sent from within the operation so that no append lands
+// between the ioctl and the end of the reply
+void seek_op_run(void* arg) {
+  struct seek_op* op = arg;
+  struct client_thread* client = op->client;
+  uint8_t opcode = op->opcode;
+  int retval = 0;
+
+  int fd = open(FILE_PATH, O_RDWR);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to open file for reading: %s", strerror(errno));
+    op->retval = ERROR_CODE;
+    return;
+  }
+  if (ioctl(fd, AESDCHAR_IOCSEEKTO, &op->seekto) != 0) {
+    syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
+    close(fd);
+    op->retval = 1;
+    return;
+  }
+  syslog(LOG_INFO, "Processed seek command: cmd=%u, offset=%u",
+         op->seekto.write_cmd, op->seekto.write_cmd_offset);
+
+  // Position is already set by ioctl, send from there to the end
+  AESD_PROBE1(seek_replay_start, client->conn_id);
+  if (opcode) {
+    // Frames need the length up front: the device reports its size on seek
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (pos < 0 || end < pos || lseek(fd, pos, SEEK_SET) != pos) {
+      retval = send_frame(client, opcode, AESD_STATUS_IO_ERROR, NULL, 0);
+    } else if (send_frame(client, opcode, AESD_STATUS_OK, NULL, end - pos) < 0 ||
+               send_file_contents(client->client_socket, fd, end - pos) !=
+                   end - pos) {
+      retval = ERROR_CODE;  // the frame is broken, drop the connection
+    }
+  } else {
+    send_file_contents(client->client_socket, fd, SIZE_MAX);
+  }
+  AESD_PROBE1(seek_replay_done, client->conn_id);
+
+  close(fd);
+  op->retval = retval;
+}
+
+// Apply AESDCHAR_IOCSEEKTO and send everything from the new position, as a
+// binary frame when opcode is non-zero. Returns 1 if the ioctl was rejected
+// (nothing sent), -1 on error.
+int send_seek_reply(struct client_thread* client, uint32_t write_cmd,
+                    uint32_t write_cmd_offset, uint8_t opcode) {
+  struct seek_op op = {
+      .client = client,
+      .seekto = {.write_cmd = write_cmd, .write_cmd_offset = write_cmd_offset},
+      .opcode = opcode,
+  };
+
+  storage_run(seek_op_run, &op);
+  return op.retval;
+}
 #endif
-      if (!file_ptr) {
-        syslog(LOG_ERR, "Failed to open file for writing: %s", strerror(errno));
-        pthread_mutex_unlock(&file_mutex);
-        free(data);
-        return NULL;
-      }
+
+// Append one newline-terminated packet to the data file (or run it as a
+// seek command) and send the reply. Returns -1 if the connection should be
+// dropped.
+int process_packet(struct client_thread* client, const char* data,
+                   size_t total_data_size) {
+  static const char grep_cmd[] = "AESDCHAR_GREP:";
+  const size_t grep_cmd_len = sizeof(grep_cmd) - 1;
+
+  // Filter command: reply with the matching records only, store nothing
+  if (total_data_size > grep_cmd_len && data[total_data_size - 1] == '\n' &&
+      0 == memcmp(data, grep_cmd, grep_cmd_len)) {
+    return send_grep(client, data + grep_cmd_len,
+                     total_data_size - grep_cmd_len - 1, 0);
+  }
 
 #ifdef USE_AESD_CHAR_DEVICE
-      // Check if this is a special seek command (step 5)
-      // Parse only if the data ends with \n and matches the format
-      if (data[total_data_size - 1] == '\n') {
-        char cmd_str[total_data_size + 1];
-        memcpy(cmd_str, data, total_data_size);
-        cmd_str[total_data_size - 1] = '\0';  // Replace \n with \0 for parsing
-        uint32_t write_cmd, write_cmd_offset;
-        if (sscanf(cmd_str, "AESDCHAR_IOCSEEKTO:%u,%u", &write_cmd, &write_cmd_offset) == 2) {
-            struct aesd_seekto seekto = {
-                .write_cmd = write_cmd,
-                .write_cmd_offset = write_cmd_offset
-            };
-            int fd = fileno(file_ptr);
-            if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0) {
-                is_seek_cmd = true;  // Flag to skip writing and resetting position
-                syslog(LOG_INFO, "Processed seek command: cmd=%u, offset=%u", write_cmd, write_cmd_offset);
-            } else {
-                syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
-            }
-        }
-        // Restore \n if needed, but since not writing, ok
+  // Check if this is a special seek command (step 5)
+  // Parse only if the data ends with \n and matches the format
+  if (data[total_data_size - 1] == '\n') {
+    char* cmd_str = arena_alloc(&client->arena, total_data_size);
+    if (!cmd_str) {
+      syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
+      return ERROR_CODE;
+    }
+    memcpy(cmd_str, data, total_data_size);
+    cmd_str[total_data_size - 1] = '\0';  // Replace \n with \0 for parsing
+    uint32_t write_cmd, write_cmd_offset;
+    if (sscanf(cmd_str, "AESDCHAR_IOCSEEKTO:%u,%u", &write_cmd, &write_cmd_offset) == 2) {
+      int retval = send_seek_reply(client, write_cmd, write_cmd_offset, 0);
+      if (retval <= 0) {
+        return retval;
       }
+      // A rejected seek is stored like any other packet
+    }
+  }
 #endif
 
-      if (!is_seek_cmd) {
-        // Write the accumulated data to the file (skip if seek command)
-        size_t bytes_written = fwrite(data, 1, total_data_size, file_ptr);
-        if (bytes_written != total_data_size) {
-            syslog(LOG_ERR, "Failed to write all data to file: wrote %zu/%zu bytes", bytes_written, total_data_size);
-        }
-        fflush(file_ptr);  // Ensure data is flushed to the device/file
+  unsigned long generation = append_to_file(client, data, total_data_size);
+  if (0 == generation) {
+    return ERROR_CODE;
+  }
+
+  // Send the full content back
+  return send_replay(client, generation, 0, 0);
+}
+
+// Handle every complete newline-terminated packet in data, one reply per
+// packet, so that pipelined packets arriving in one recv() are answered in
+// order. Bytes from scanned on have not been searched for a newline yet;
+// their newlines are located a batch at a time.
+// Returns the number of bytes consumed, or -1 to drop the connection.
+ssize_t process_text(struct client_thread* client, const char* data,
+                     size_t total_data_size, size_t scanned) {
+  size_t newlines[TEXT_NEWLINE_BATCH];
+  size_t packet_start = 0;
+  size_t found;
+
+  do {
+    found = delimscan_index(data + scanned, total_data_size - scanned, '\n',
+                            newlines, TEXT_NEWLINE_BATCH);
+    for (size_t i = 0; i < found; i++) {
+      size_t packet_end = scanned + newlines[i] + 1;
+      capture_event(CAPTURE_PACKET, client->conn_id, false,
+                    data + packet_start, packet_end - packet_start);
+      ratelimit_throttle(&client->limit, client->source,
+                         packet_end - packet_start);
+      client->packets++;
+      int retval = process_packet(client, data + packet_start,
+                                  packet_end - packet_start);
+      arena_reset(&client->arena);
+      if (retval < 0) {
+        return ERROR_CODE;
       }
+      packet_start = packet_end;
+    }
+    scanned = packet_start;  // a full batch may have left newlines behind
+  } while (found == TEXT_NEWLINE_BATCH);
+  return packet_start;
+}
 
-      // Reset position to start only if not a seek command (for sending full content)
-      if (!is_seek_cmd) {
-        if (fseek(file_ptr, 0, SEEK_SET) != 0) {
-            syslog(LOG_ERR, "Failed to seek to start of file: %s", strerror(errno));
-        }
+// Execute one binary protocol request. Returns -1 to drop the connection.
+int process_frame(struct client_thread* client, struct aesd_frame frame,
+                  const char* payload) {
+  ratelimit_throttle(&client->limit, client->source, frame.length);
+  client->packets++;
+
+  switch (frame.opcode) {
+    case AESD_OP_APPEND: {
+      unsigned long generation = append_to_file(client, payload, frame.length);
+      if (0 == generation) {
+        return send_frame(client, frame.opcode, AESD_STATUS_IO_ERROR, NULL, 0);
+      }
+      if (frame.flags & AESD_FLAG_REPLAY) {
+        return send_replay(client, generation, 0, frame.opcode);
+      }
+      return send_frame(client, frame.opcode, AESD_STATUS_OK, NULL, 0);
+    }
+    case AESD_OP_REPLAY:
+      return send_replay(client, current_generation(), 0, frame.opcode);
+    case AESD_OP_GREP:
+      return send_grep(client, payload, frame.length, frame.opcode);
+    case AESD_OP_TAIL:
+      if (frame.length != 8) {
+        break;
+      }
+      return send_replay(client, current_generation(),
+                         aesd_get_u64((const uint8_t*)payload), frame.opcode);
+    case AESD_OP_SEEKTO:
+      if (frame.length != 8) {
+        break;
       }
-      // If seek command, position is already set by ioctl, read from there
-
-      // Send the file content back to the client (from current position)
-      ssize_t bytes_read;
-      while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file_ptr)) > 0) {
-        if (send(client->client_socket, buffer, bytes_read, 0) != bytes_read) {
-            syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
-            break;
+#ifdef USE_AESD_CHAR_DEVICE
+      {
+        int retval = send_seek_reply(
+            client, aesd_get_u32((const uint8_t*)payload),
+            aesd_get_u32((const uint8_t*)payload + 4), frame.opcode);
+        if (retval <= 0) {
+          return retval;
         }
       }
+      break;  // rejected by the driver
+#else
+      return send_frame(client, frame.opcode, AESD_STATUS_UNSUPPORTED, NULL, 0);
+#endif
+    default:
+      break;
+  }
+  return send_frame(client, frame.opcode, AESD_STATUS_BAD_REQUEST, NULL, 0);
+}
+
+// Handle every complete frame in data. Payloads are used in place, without
+// scanning. Returns the number of bytes consumed, or -1 to drop the
+// connection.
+ssize_t process_binary(struct client_thread* client, const char* data,
+                       size_t total_data_size) {
+  size_t pos = 0;
+
+  while (total_data_size - pos >= AESD_FRAME_HEADER_SIZE) {
+    struct aesd_frame frame = aesd_frame_decode((const uint8_t*)data + pos);
+    if (frame.length > AESD_FRAME_MAX_PAYLOAD) {
+      syslog(LOG_ERR, "Frame of %u bytes exceeds the limit", frame.length);
+      return ERROR_CODE;
+    }
+    if (total_data_size - pos - AESD_FRAME_HEADER_SIZE < frame.length) {
+      break;  // wait for the rest of the payload
+    }
+    capture_event(CAPTURE_PACKET, client->conn_id, true, data + pos,
+                  AESD_FRAME_HEADER_SIZE + frame.length);
+    int retval =
+        process_frame(client, frame, data + pos + AESD_FRAME_HEADER_SIZE);
+    arena_reset(&client->arena);
+    if (retval < 0) {
+      return ERROR_CODE;
+    }
+    pos += AESD_FRAME_HEADER_SIZE + frame.length;
+  }
+  return pos;
+}
+
+void* handle_client_connection(void* arg) {
+  struct client_thread* client = (struct client_thread*)arg;
+  char* data;  // receive buffer, owned by the connection's arena
+  size_t total_data_size = 0;
+  ssize_t bytes_received;
+  bool first_recv = true;
+  bool binary = false;
+  client->thread_id = pthread_self();
+  syslog(LOG_INFO, "Thread [%lu] handling client socket [%d]",
+         client->thread_id, client->client_socket);
+  affinity_apply_worker(client->client_socket);
+
+  // Receive data from the client straight into the end of the buffer
+  while ((data = arena_buffer_reserve(&client->arena, total_data_size,
+                                      total_data_size + BUFFER_SIZE)) &&
+         (bytes_received = recv(client->client_socket, data + total_data_size,
+                                BUFFER_SIZE, 0)) > 0) {
+    AESD_PROBE2(recv, client->conn_id, bytes_received);
+
+    // A leading magic byte selects the binary protocol for the connection
+    if (first_recv) {
+      first_recv = false;
+      if ((uint8_t)data[0] == AESD_PROTO_MAGIC) {
+        binary = true;
+        bytes_received--;
+        memmove(data, data + 1, bytes_received);
+      }
+      capture_event(CAPTURE_OPEN, client->conn_id, binary, NULL, 0);
+    }
+    if (0 == bytes_received) {
+      continue;
+    }
 
-      // Close the file
-      fclose(file_ptr);
-      file_ptr = NULL;
-      pthread_mutex_unlock(&file_mutex);
+    size_t scanned = total_data_size;  // older bytes hold no newline
+    total_data_size += bytes_received;
 
+    ssize_t consumed =
+        binary ? process_binary(client, data, total_data_size)
+               : process_text(client, data, total_data_size, scanned);
+    if (consumed < 0) {
+      break;
+    }
+    if (consumed > 0) {
       // Reset data for next packet
-      free(data);
-      data = NULL;
-      total_data_size = 0;
+      total_data_size -= consumed;
+      memmove(data, data + consumed, total_data_size);
+      if (0 == total_data_size) {
+        arena_buffer_trim(&client->arena);
+      }
     }
   }
+  if (!data) {
+    syslog(LOG_ERR, "Failed to allocate memory: %s", strerror(errno));
+  }
 
   // Cleanup
-  if (data) {
-    free(data);
+  AESD_PROBE2(conn_close, client->conn_id, total_data_size);
+  if (!first_recv) {
+    capture_event(CAPTURE_CLOSE, client->conn_id, binary, NULL, 0);
   }
-  client->complete = true;
+  arena_release(&client->arena);
+  close(client->client_socket);
+  ratelimit_conn_destroy(&client->limit);
+  ratelimit_source_put(client->source);
+  registry_remove(client->conn_id);  // frees client
   return NULL;
 }
 
@@ -302,26 +901,291 @@ void daemonize() {
   close(fd_null);
 }
 
+// Create, bind and listen on the AF_UNIX stream socket at path.
+// A stale socket file left behind by a previous run is removed first.
+int open_unix_listener(const char* path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path[0] != '/') {
+    // daemonize() changes to "/", so keep an absolute path for unlink()
+    char cwd[sizeof(addr.sun_path)];
+    if (NULL == getcwd(cwd, sizeof(cwd)) ||
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", cwd, path) >=
+            (int)sizeof(addr.sun_path)) {
+      syslog(LOG_ERR, "AF_UNIX socket path too long: %s", path);
+      return ERROR_CODE;
+    }
+  } else if (strlen(path) >= sizeof(addr.sun_path)) {
+    syslog(LOG_ERR, "AF_UNIX socket path too long: %s", path);
+    return ERROR_CODE;
+  } else {
+    strcpy(addr.sun_path, path);
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (ERROR_CODE == fd) {
+    syslog(LOG_ERR, "Failed to create AF_UNIX socket: %s", strerror(errno));
+    return ERROR_CODE;
+  }
+
+  unlink(addr.sun_path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    syslog(LOG_ERR, "Failed to bind AF_UNIX socket %s: %s", addr.sun_path,
+           strerror(errno));
+    close(fd);
+    return ERROR_CODE;
+  }
+  if (listen(fd, BACKLOG) < 0) {
+    syslog(LOG_ERR, "Failed to listen on AF_UNIX socket: %s", strerror(errno));
+    close(fd);
+    unlink(addr.sun_path);
+    return ERROR_CODE;
+  }
+
+  strcpy(unix_socket_path, addr.sun_path);
+  syslog(LOG_DEBUG, "Server is listening on %s", unix_socket_path);
+  return fd;
+}
+
+// Accept one pending connection on listen_fd and hand it to a client thread.
+// AF_UNIX peers are identified (and optionally filtered) with SO_PEERCRED.
+void accept_client(int listen_fd) {
+  struct sockaddr_storage client_addr;
+  socklen_t client_addr_len = sizeof(client_addr);
+  char client_ip[INET6_ADDRSTRLEN];
+  char source_key[INET6_ADDRSTRLEN];  // rate limiting key: IP or AF_UNIX uid
+  int client_socket;
+
+  // Accept a connection
+  client_socket =
+      accept(listen_fd, (struct sockaddr*)&client_addr, &client_addr_len);
+  if (ERROR_CODE == client_socket) {
+    syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+    return;
+  }
+
+  if (AF_UNIX == client_addr.ss_family) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(client_socket, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) <
+        0) {
+      syslog(LOG_ERR, "Failed to get peer credentials: %s", strerror(errno));
+      close(client_socket);
+      return;
+    }
+    if (unix_allowed_uid >= 0 && cred.uid != (uid_t)unix_allowed_uid) {
+      syslog(LOG_WARNING, "Rejected local connection from pid %d uid %u",
+             (int)cred.pid, (unsigned)cred.uid);
+      close(client_socket);
+      return;
+    }
+    syslog(LOG_INFO, "Accepted local connection from pid %d uid %u",
+           (int)cred.pid, (unsigned)cred.uid);
+    snprintf(source_key, sizeof(source_key), "uid:%u", (unsigned)cred.uid);
+  } else if (inet_ntop(AF_INET,
+                       &((struct sockaddr_in*)&client_addr)->sin_addr,
+                       client_ip, sizeof(client_ip)) != NULL) {
+    // Get the client IP address and log it
+    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+    snprintf(source_key, sizeof(source_key), "%s", client_ip);
+  } else {
+    syslog(LOG_ERR, "Failed to get client IP address");
+    strcpy(source_key, "unknown");
+  }
+
+  // Register the connection; its thread removes it again when done
+  uint64_t conn_id;
+  struct client_thread* thread_info = registry_add(&conn_id);
+  if (NULL == thread_info) {
+    close(client_socket);
+    return;
+  }
+  last_conn_id = conn_id;
+  thread_info->conn_id = conn_id;
+  thread_info->client_socket = client_socket;
+  ratelimit_conn_init(&thread_info->limit);
+  thread_info->source = ratelimit_source_get(source_key);
+  AESD_PROBE3(accept, thread_info->conn_id, client_socket,
+              client_addr.ss_family);
+
+  pthread_t thread_id;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread_id, &attr, handle_client_connection,
+                     thread_info) != 0) {
+    syslog(LOG_ERR, "Failed to create thread: %s", strerror(errno));
+    close(client_socket);
+    ratelimit_conn_destroy(&thread_info->limit);
+    ratelimit_source_put(thread_info->source);
+    registry_remove(conn_id);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void request_stats(int signo) {
+  stats_requested = 1;
+}
+
+void request_shutdown(int signo) {
+  shutdown_signal = signo;
+}
+
+void log_connection(void* object, void* arg) {
+  struct client_thread* client = object;
+  syslog(LOG_DEBUG, "connection %llx: socket=%d packets=%lu",
+         (unsigned long long)client->conn_id, client->client_socket,
+         client->packets);
+}
+
+// Log runtime statistics of the server components (on SIGUSR1)
+void log_stats(void) {
+  syslog(LOG_INFO, "stats: data_generation=%lu", data_generation);
+  registry_log_stats();
+  arena_log_stats();
+  registry_foreach(log_connection, NULL);
+  durability_log_stats();
+  storage_log_stats();
+  ratelimit_log_stats();
+  records_log_stats();
+  capture_log_stats();
+}
+
+void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-d] [-u <socket path> [-U <uid>]] [-s <mode>]\n"
+          "          [-r <pps>:<bps>] [-R <pps>:<bps>] [-f]\n"
+          "          [-a <role>=<cpus>]... [-C <file>] [-w]\n"
+          "  -d, --daemon           run as a daemon\n"
+          "  -u, --unix <path>      also listen on an AF_UNIX socket at <path>\n"
+          "  -U, --unix-uid <uid>   only accept AF_UNIX peers with this uid\n"
+          "  -s, --sync <mode>      durability: none (default), packet,\n"
+          "                         group[:<ms>] (1-60000) or ack (not with the\n"
+          "                         aesdchar device)\n"
+          "  -r, --rate-limit <pps>:<bps>\n"
+          "                         packets/s and bytes/s per connection\n"
+          "  -R, --source-rate-limit <pps>:<bps>\n"
+          "                         packets/s and bytes/s per source IP/uid\n"
+          "                         (0 means unlimited)\n"
+          "  -f, --records          store packets as CRC32C-checked records;\n"
+          "                         the file is recovered on startup and kept\n"
+          "                         on exit (not with the aesdchar device)\n"
+          "  -a, --affinity <role>=<cpus>\n"
+          "                         pin accept, worker or timestamp threads to\n"
+          "                         a cpu list (0-3,6), isolated, housekeeping\n"
+          "                         or, for workers, incoming (the CPU that\n"
+          "                         received the connection's packets)\n"
+          "  -C, --capture <file>   record inbound traffic for aesdreplay\n"
+          "  -w, --storage-thread   let one thread own the data file; clients\n"
+          "                         queue their packets to it\n"
+          "Send SIGUSR1 to log server statistics.\n",
+          prog);
+}
+
 int main(int argc, char* argv[]) {
   int server_fd;
-  int client_socket;
   struct addrinfo hints;
   struct addrinfo* res;
   struct addrinfo* p;
-  struct sockaddr_storage client_addr;
-  socklen_t client_addr_len = sizeof(client_addr);
-  char client_ip[INET6_ADDRSTRLEN];
   int daemon_mode = 0;
-
-  // Check for "-d" argument
-  if (2 == argc && 0 == strcmp(argv[1], "-d")) {
-    daemon_mode = 1;
+  const char* unix_path = NULL;
+  bool use_records = false;
+  const char* capture_path = NULL;
+  int opt_char;
+
+  static const struct option long_options[] = {
+      {"daemon", no_argument, NULL, 'd'},
+      {"unix", required_argument, NULL, 'u'},
+      {"unix-uid", required_argument, NULL, 'U'},
+      {"sync", required_argument, NULL, 's'},
+      {"rate-limit", required_argument, NULL, 'r'},
+      {"source-rate-limit", required_argument, NULL, 'R'},
+      {"records", no_argument, NULL, 'f'},
+      {"affinity", required_argument, NULL, 'a'},
+      {"capture", required_argument, NULL, 'C'},
+      {"storage-thread", no_argument, NULL, 'w'},
+      {NULL, 0, NULL, 0}};
+
+  // Parse command line options ("-d" keeps its original meaning)
+  while ((opt_char = getopt_long(argc, argv, "du:U:s:r:R:fa:C:w", long_options, NULL)) !=
+         -1) {
+    switch (opt_char) {
+      case 'd':
+        daemon_mode = 1;
+        break;
+      case 'u':
+        unix_path = optarg;
+        break;
+      case 'U': {
+        // A negative uid would disable the filter, so only real uids pass
+        char* end;
+        errno = 0;
+        long uid = strtol(optarg, &end, 10);
+        if (errno != 0 || end == optarg || *end != '\0' || uid < 0 ||
+            (unsigned long)uid >= (uid_t)-1) {
+          fprintf(stderr, "Invalid uid: %s\n", optarg);
+          usage(argv[0]);
+          exit(ERROR_CODE);
+        }
+        unix_allowed_uid = uid;
+        break;
+      }
+      case 's':
+        if (durability_configure(optarg) < 0) {
+          fprintf(stderr, "Invalid durability mode: %s\n", optarg);
+          usage(argv[0]);
+          exit(ERROR_CODE);
+        }
+#ifdef USE_AESD_CHAR_DEVICE
+        // aesdchar has no .fsync, every fdatasync would fail with EINVAL
+        if (strcmp(optarg, "none") != 0) {
+          fprintf(stderr, "--sync %s needs the regular data file\n", optarg);
+          exit(ERROR_CODE);
+        }
+#endif
+        break;
+      case 'r':
+      case 'R':
+        if (ratelimit_configure(optarg, 'R' == opt_char) < 0) {
+          fprintf(stderr, "Invalid rate limit: %s\n", optarg);
+          usage(argv[0]);
+          exit(ERROR_CODE);
+        }
+        break;
+      case 'f':
+#ifdef USE_AESD_CHAR_DEVICE
+        fprintf(stderr, "--records needs the regular data file\n");
+        exit(ERROR_CODE);
+#else
+        use_records = true;
+        break;
+#endif
+      case 'a':
+        if (affinity_configure(optarg) < 0) {
+          fprintf(stderr, "Invalid CPU affinity: %s\n", optarg);
+          usage(argv[0]);
+          exit(ERROR_CODE);
+        }
+        break;
+      case 'C':
+        capture_path = optarg;
+        break;
+      case 'w':
+        storage_use_thread();
+        break;
+      default:
+        usage(argv[0]);
+        exit(ERROR_CODE);
+    }
   }
 
   // Register signal handlers for SIGINT and SIGTERM
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = cleanup_and_exit;  // Set the handler function
+  sa.sa_handler = request_shutdown;  // Set the handler function
   sigemptyset(&sa.sa_mask);          // No additional signals are blocked
   sa.sa_flags = 0;                   // No special flags
 
@@ -337,6 +1201,27 @@ int main(int argc, char* argv[]) {
     exit(ERROR_CODE);
   }
 
+  // SIGUSR1 only sets a flag, the accept loop does the logging
+  sa.sa_handler = request_stats;
+  if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+    syslog(LOG_ERR, "Failed to set signal handler for SIGUSR1: %s",
+           strerror(errno));
+    exit(ERROR_CODE);
+  }
+
+  // Keep the handled signals blocked except while the accept loop waits in
+  // ppoll(). Threads inherit the blocked mask, so the handlers always run
+  // in the main thread and shutdown never runs on a connection thread.
+  sigset_t handled_signals;
+  sigset_t wait_mask;
+  sigemptyset(&handled_signals);
+  sigaddset(&handled_signals, SIGINT);
+  sigaddset(&handled_signals, SIGTERM);
+  sigaddset(&handled_signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &handled_signals, &wait_mask);
+
+  registry_init(sizeof(struct client_thread));
+
   // Open syslog for logging
   openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
   printf("Starting server and work with file: %s%s%s\n", BLUE, FILE_PATH, NC);
@@ -385,6 +1270,28 @@ int main(int argc, char* argv[]) {
   }
 
   freeaddrinfo(res);
+  server_socket = server_fd;
+
+  // Bind the AF_UNIX listener before daemonizing so errors reach the caller
+  if (unix_path) {
+    unix_socket = open_unix_listener(unix_path);
+    if (ERROR_CODE == unix_socket) {
+      close(server_fd);
+      return ERROR_CODE;
+    }
+  }
+
+  // Validate the record file, truncating a torn tail from a crash, and
+  // create the capture file while relative paths still work
+  if ((use_records && records_open(FILE_PATH) < 0) ||
+      (capture_path && capture_open(capture_path) < 0)) {
+    close(server_fd);
+    if (unix_socket >= 0) {
+      close(unix_socket);
+      unlink(unix_socket_path);
+    }
+    return ERROR_CODE;
+  }
 
   // If daemon mode is enabled, daemonize the process
   if (daemon_mode) {
@@ -392,6 +1299,12 @@ int main(int argc, char* argv[]) {
     daemonize();
   }
 
+  // Threads don't survive fork(), so start the syncer and the storage thread
+  // after daemonizing
+  if (durability_start(FILE_PATH) < 0 || storage_start() < 0) {
+    return ERROR_CODE;
+  }
+
 #ifndef USE_AESD_CHAR_DEVICE
   // Start thread for writing timestamp
   pthread_create(&timestamp_thread, NULL, timestamp_writer, NULL);
@@ -405,53 +1318,36 @@ int main(int argc, char* argv[]) {
   }
   syslog(LOG_DEBUG, "Server is listening on port %s", PORT);
 
-  while (1) {
-    // Accept a connection
-    client_socket =
-        accept(server_fd, (struct sockaddr*)&client_addr, &client_addr_len);
-    if (ERROR_CODE == client_socket) {
-      syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
-      // return ERROR_CODE; // if case of foreground process
-      continue;  // in case of daemonize
-    }
+  // Pin the accept loop last: threads inherit the affinity of their creator
+  affinity_log_config();
+  affinity_apply(AFFINITY_ACCEPT);
 
-    // Get the client IP address and log it
-    if (inet_ntop(AF_INET, &((struct sockaddr_in*)&client_addr)->sin_addr,
-                  client_ip, sizeof(client_ip)) != NULL) {
-      syslog(LOG_INFO, "Accepted connection from %s", client_ip);
-    } else {
-      syslog(LOG_ERR, "Failed to get client IP address");
-    }
+  // Wait on the TCP listener and, if enabled, the AF_UNIX listener
+  struct pollfd listen_fds[2] = {
+      {.fd = server_fd, .events = POLLIN},
+      {.fd = unix_socket, .events = POLLIN},  // negative fd is ignored
+  };
 
-    // Allocate memory for thread structure
-    struct client_thread* thread_info = malloc(sizeof(struct client_thread));
-    if (NULL == thread_info) {
-      syslog(LOG_ERR, "Failed to allocate memory for thread_info");
-      close(client_socket);
-      continue;
-    }
-    thread_info->client_socket = client_socket;
-    thread_info->complete = false;
-    if (pthread_create(&thread_info->thread_id, NULL, handle_client_connection,
-                       thread_info) != 0) {
-      syslog(LOG_ERR, "Failed to create thread: %s", strerror(errno));
-      close(client_socket);
-      free(thread_info);
-      continue;
+  while (1) {
+    AESD_PROBE1(accept_wait, last_conn_id);
+    if (ppoll(listen_fds, 2, NULL, &wait_mask) < 0) {
+      if (errno != EINTR) {
+        syslog(LOG_ERR, "Failed to poll listeners: %s", strerror(errno));
+      }
+      if (shutdown_signal) {
+        cleanup_and_exit(shutdown_signal);
+      }
+      if (stats_requested) {
+        stats_requested = 0;
+        log_stats();
+      }
+      continue;  // in case of daemonize
     }
-    SLIST_INSERT_HEAD(&thread_head, thread_info, entries);
-
-    // Clean up completed threads
-    struct client_thread* thread_ptr;
-    struct client_thread* temp;
-    SLIST_FOREACH_SAFE(thread_ptr, &thread_head, entries, temp) {
-      if (thread_ptr->complete) {
-        pthread_join(thread_ptr->thread_id, NULL);
-        SLIST_REMOVE(&thread_head, thread_ptr, client_thread, entries);
-        free(thread_ptr);
+    for (int i = 0; i < 2; i++) {
+      if (listen_fds[i].revents & POLLIN) {
+        accept_client(listen_fds[i].fd);
       }
     }
-
   }
 
   syslog(LOG_DEBUG, "Server closed");
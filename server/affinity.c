@@ -0,0 +1,187 @@
+#define _GNU_SOURCE  // cpu_set_t, pthread_setaffinity_np
+
+#include "affinity.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+#define CPU_SYSFS "/sys/devices/system/cpu/"
+
+static const char* role_names[AFFINITY_ROLES] = {
+    [AFFINITY_ACCEPT] = "accept",
+    [AFFINITY_WORKER] = "worker",
+    [AFFINITY_TIMESTAMP] = "timestamp",
+};
+
+// Configured CPU sets; roles without one use initial_set
+static cpu_set_t role_sets[AFFINITY_ROLES];
+static bool role_configured[AFFINITY_ROLES];
+static char role_specs[AFFINITY_ROLES][64];
+static bool worker_incoming = false;
+static cpu_set_t initial_set;
+static bool any_configured = false;
+
+// Parse a kernel cpu list ("0-3,8,10-11") into set
+static int parse_cpu_list(const char* list, cpu_set_t* set) {
+  const char* p = list;
+
+  CPU_ZERO(set);
+  while (*p && *p != '\n') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) {
+      return -1;
+    }
+    if ('-' == *end) {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return -1;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    p = end;
+    if (',' == *p) {
+      p++;
+    } else if (*p && *p != '\n') {
+      return -1;
+    }
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Read a cpu list file from sysfs; an empty list yields an empty set
+static int read_sysfs_cpus(const char* name, cpu_set_t* set) {
+  char path[64];
+  char list[1024] = "";
+
+  snprintf(path, sizeof(path), CPU_SYSFS "%s", name);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  if (!fgets(list, sizeof(list), file)) {
+    list[0] = '\0';
+  }
+  fclose(file);
+  if ('\0' == list[0] || '\n' == list[0]) {
+    CPU_ZERO(set);
+    return 0;
+  }
+  return parse_cpu_list(list, set);
+}
+
+static int resolve_cpus(const char* cpus, cpu_set_t* set) {
+  if (0 == strcmp(cpus, "isolated")) {
+    if (read_sysfs_cpus("isolated", set) < 0 || 0 == CPU_COUNT(set)) {
+      fprintf(stderr, "No isolated CPUs (boot with isolcpus=)\n");
+      return -1;
+    }
+    return 0;
+  }
+  if (0 == strcmp(cpus, "housekeeping")) {
+    cpu_set_t isolated;
+    if (read_sysfs_cpus("online", set) < 0 ||
+        read_sysfs_cpus("isolated", &isolated) < 0) {
+      return -1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &isolated)) {
+        CPU_CLR(cpu, set);
+      }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+  }
+  return parse_cpu_list(cpus, set);
+}
+
+int affinity_configure(const char* spec) {
+  const char* cpus = strchr(spec, '=');
+  int role;
+
+  if (!cpus) {
+    return -1;
+  }
+  for (role = 0; role < AFFINITY_ROLES; role++) {
+    if (strlen(role_names[role]) == (size_t)(cpus - spec) &&
+        0 == strncmp(spec, role_names[role], cpus - spec)) {
+      break;
+    }
+  }
+  if (AFFINITY_ROLES == role) {
+    return -1;
+  }
+  cpus++;
+
+  if (!any_configured &&
+      sched_getaffinity(0, sizeof(initial_set), &initial_set) < 0) {
+    return -1;
+  }
+  if (AFFINITY_WORKER == role && 0 == strcmp(cpus, "incoming")) {
+    worker_incoming = true;
+  } else if (resolve_cpus(cpus, &role_sets[role]) < 0) {
+    return -1;
+  } else {
+    role_configured[role] = true;
+  }
+  snprintf(role_specs[role], sizeof(role_specs[role]), "%s", cpus);
+  any_configured = true;
+  return 0;
+}
+
+static void pin_thread(const cpu_set_t* set, const char* what) {
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+  if (err != 0) {
+    syslog(LOG_ERR, "Failed to pin %s thread: %s", what, strerror(err));
+  }
+}
+
+void affinity_apply(enum affinity_role role) {
+  if (!any_configured) {
+    return;  // leave scheduling alone entirely
+  }
+  pin_thread(role_configured[role] ? &role_sets[role] : &initial_set,
+             role_names[role]);
+}
+
+void affinity_apply_worker(int client_socket) {
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+
+  // Stay on the core whose softirq handled this connection's packets, so
+  // socket buffers are still hot in its cache. AF_UNIX sockets have none.
+  if (worker_incoming &&
+      0 == getsockopt(client_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                      &len) &&
+      cpu >= 0 && cpu < CPU_SETSIZE) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pin_thread(&set, role_names[AFFINITY_WORKER]);
+    return;
+  }
+  affinity_apply(AFFINITY_WORKER);
+}
+
+void affinity_log_config(void) {
+  for (int role = 0; role < AFFINITY_ROLES; role++) {
+    if (role_specs[role][0]) {
+      syslog(LOG_INFO, "CPU affinity: %s threads on %s (%d CPUs)",
+             role_names[role], role_specs[role],
+             role_configured[role] ? CPU_COUNT(&role_sets[role]) : 1);
+    }
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef AESDSOCKET_AFFINITY_H
+#define AESDSOCKET_AFFINITY_H
+
+/**
+ * Thread roles that can be pinned to their own CPU set.
+ */
+enum affinity_role {
+  AFFINITY_ACCEPT,     // main thread running the accept loop
+  AFFINITY_WORKER,     // per-connection threads
+  AFFINITY_TIMESTAMP,  // timestamp writer
+  AFFINITY_ROLES,
+};
+
+/**
+ * Parse "<role>=<cpus>", role being accept, worker or timestamp. cpus is a
+ * cpu list ("0-3,6"), "isolated" (the isolcpus= cores), "housekeeping"
+ * (online cores that are not isolated) or, for workers, "incoming": the
+ * core that received the connection's packets (SO_INCOMING_CPU).
+ * @return 0 on success, -1 if spec is invalid
+ */
+int affinity_configure(const char* spec);
+
+/**
+ * Pin the calling thread according to its role. Roles without a policy get
+ * the CPU set the process started with, so they do not inherit the accept
+ * thread's pinning.
+ */
+void affinity_apply(enum affinity_role role);
+
+/**
+ * Pin the calling worker thread for the connection on client_socket.
+ */
+void affinity_apply_worker(int client_socket);
+
+/**
+ * Log the configured policy to syslog.
+ */
+void affinity_log_config(void);
+
+#endif /* AESDSOCKET_AFFINITY_H */
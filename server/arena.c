@@ -0,0 +1,186 @@
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define ARENA_MIN_CHUNK 4096     // smallest size class, header included
+#define ARENA_CLASSES 13         // 4 KiB .. 16 MiB
+#define ARENA_HUGE ARENA_CLASSES  // bigger chunks bypass the pool
+// Free chunks the pool keeps cached before handing memory back to malloc
+#define ARENA_POOL_MAX_BYTES (32u * 1024 * 1024)
+
+struct arena_chunk {
+  struct arena_chunk* next;
+  size_t size;      // whole chunk, header included
+  unsigned size_class;
+  alignas(max_align_t) char data[];
+};
+
+// Global pool, protected by pool_mutex
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct arena_chunk* pool[ARENA_CLASSES];
+static size_t pool_cached = 0;
+static size_t in_use = 0;       // bytes held by live arenas
+static size_t peak_in_use = 0;
+static size_t max_conn_peak = 0;
+static unsigned long pool_hits = 0;
+static unsigned long pool_misses = 0;
+
+static size_t class_size(unsigned size_class) {
+  return (size_t)ARENA_MIN_CHUNK << size_class;
+}
+
+static struct arena_chunk* chunk_get(struct arena* arena, size_t capacity) {
+  size_t needed = sizeof(struct arena_chunk) + capacity;
+  unsigned size_class = 0;
+  struct arena_chunk* chunk = NULL;
+
+  while (size_class < ARENA_CLASSES && class_size(size_class) < needed) {
+    size_class++;
+  }
+  size_t size = size_class < ARENA_CLASSES ? class_size(size_class) : needed;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (size_class < ARENA_CLASSES && pool[size_class]) {
+    chunk = pool[size_class];
+    pool[size_class] = chunk->next;
+    pool_cached -= size;
+    pool_hits++;
+  } else {
+    pool_misses++;
+  }
+  in_use += size;
+  if (in_use > peak_in_use) {
+    peak_in_use = in_use;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  if (!chunk) {
+    chunk = malloc(size);
+    if (!chunk) {
+      pthread_mutex_lock(&pool_mutex);
+      in_use -= size;
+      pthread_mutex_unlock(&pool_mutex);
+      return NULL;
+    }
+    chunk->size = size;
+    chunk->size_class = size_class;
+  }
+  chunk->next = NULL;
+  arena->held += size;
+  if (arena->held > arena->peak) {
+    arena->peak = arena->held;
+  }
+  return chunk;
+}
+
+static void chunk_put(struct arena* arena, struct arena_chunk* chunk) {
+  arena->held -= chunk->size;
+
+  pthread_mutex_lock(&pool_mutex);
+  in_use -= chunk->size;
+  if (chunk->size_class < ARENA_CLASSES &&
+      pool_cached + chunk->size <= ARENA_POOL_MAX_BYTES) {
+    chunk->next = pool[chunk->size_class];
+    pool[chunk->size_class] = chunk;
+    pool_cached += chunk->size;
+    chunk = NULL;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  free(chunk);  // huge, or the pool is full
+}
+
+static size_t chunk_capacity(const struct arena_chunk* chunk) {
+  return chunk->size - sizeof(struct arena_chunk);
+}
+
+char* arena_buffer_reserve(struct arena* arena, size_t used, size_t size) {
+  if (arena->buffer && chunk_capacity(arena->buffer) >= size) {
+    return arena->buffer->data;
+  }
+  // Grow geometrically so a large packet costs O(log n) moves
+  size_t capacity = arena->buffer ? chunk_capacity(arena->buffer) * 2 : 0;
+  struct arena_chunk* chunk = chunk_get(arena, capacity > size ? capacity : size);
+  if (!chunk) {
+    return NULL;
+  }
+  if (arena->buffer) {
+    memcpy(chunk->data, arena->buffer->data, used);
+    chunk_put(arena, arena->buffer);
+  }
+  arena->buffer = chunk;
+  return chunk->data;
+}
+
+void arena_buffer_trim(struct arena* arena) {
+  if (arena->buffer && arena->buffer->size_class > 0) {
+    chunk_put(arena, arena->buffer);
+    arena->buffer = NULL;
+  }
+}
+
+void* arena_alloc(struct arena* arena, size_t size) {
+  size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+  if (!arena->scratch ||
+      chunk_capacity(arena->scratch) - arena->scratch_used < size) {
+    struct arena_chunk* chunk = chunk_get(arena, size);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->next = arena->scratch;
+    arena->scratch = chunk;
+    arena->scratch_used = 0;
+  }
+  void* memory = arena->scratch->data + arena->scratch_used;
+  arena->scratch_used += size;
+  return memory;
+}
+
+void arena_reset(struct arena* arena) {
+  struct arena_chunk* chunk = arena->scratch;
+
+  if (!chunk) {
+    return;
+  }
+  // Keep the oldest chunk, which is the one every packet starts with
+  while (chunk->next) {
+    struct arena_chunk* next = chunk->next;
+    chunk_put(arena, chunk);
+    chunk = next;
+  }
+  arena->scratch = chunk;
+  arena->scratch_used = 0;
+}
+
+void arena_release(struct arena* arena) {
+  while (arena->scratch) {
+    struct arena_chunk* next = arena->scratch->next;
+    chunk_put(arena, arena->scratch);
+    arena->scratch = next;
+  }
+  if (arena->buffer) {
+    chunk_put(arena, arena->buffer);
+    arena->buffer = NULL;
+  }
+  arena->scratch_used = 0;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (arena->peak > max_conn_peak) {
+    max_conn_peak = arena->peak;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+void arena_log_stats(void) {
+  pthread_mutex_lock(&pool_mutex);
+  syslog(LOG_INFO,
+         "arena: in_use=%zu peak_in_use=%zu pool_cached=%zu "
+         "max_connection_peak=%zu pool_hits=%lu pool_misses=%lu",
+         in_use, peak_in_use, pool_cached, max_conn_peak, pool_hits,
+         pool_misses);
+  pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,58 @@
+#ifndef AESDSOCKET_ARENA_H
+#define AESDSOCKET_ARENA_H
+
+#include <stddef.h>
+
+struct arena_chunk;
+
+/**
+ * Per-connection memory: a receive buffer plus bump-allocated scratch space
+ * for building replies. Both are made of chunks taken from a global pool of
+ * power-of-two size classes, so connections recycle each other's memory
+ * instead of going through malloc for every packet. A zeroed struct arena
+ * is ready to use.
+ */
+struct arena {
+  struct arena_chunk* scratch;  // scratch chunks, newest first
+  size_t scratch_used;          // bytes used in the newest scratch chunk
+  struct arena_chunk* buffer;   // receive buffer
+  size_t held;                  // bytes of all chunks held
+  size_t peak;                  // highest value of held
+};
+
+/**
+ * Make the receive buffer hold at least size bytes, keeping its first used
+ * bytes. The buffer may move.
+ * @return the buffer, or NULL if out of memory (the old buffer is kept)
+ */
+char* arena_buffer_reserve(struct arena* arena, size_t used, size_t size);
+
+/**
+ * Return an oversized, empty receive buffer to the pool after a large
+ * packet, so that an idle connection only holds the smallest chunk.
+ */
+void arena_buffer_trim(struct arena* arena);
+
+/**
+ * Allocate size bytes of scratch space, valid until the next reset.
+ * @return the memory, or NULL if out of memory
+ */
+void* arena_alloc(struct arena* arena, size_t size);
+
+/**
+ * Drop all scratch allocations. The first chunk is kept for the next
+ * packet; any others go back to the pool.
+ */
+void arena_reset(struct arena* arena);
+
+/**
+ * Return every chunk to the pool (when the connection closes).
+ */
+void arena_release(struct arena* arena);
+
+/**
+ * Log pool and per-connection memory use to syslog.
+ */
+void arena_log_stats(void);
+
+#endif /* AESDSOCKET_ARENA_H */
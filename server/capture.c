@@ -0,0 +1,101 @@
+#include "capture.h"
+#include "aesd_protocol.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+static FILE* capture_file = NULL;
+// Serialises events so that each one is contiguous in the file
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capture_start;
+static unsigned long events_written = 0;
+static unsigned long long bytes_written = 0;
+static bool write_failed = false;
+
+int capture_open(const char* path) {
+  uint8_t header[CAPTURE_FILE_HEADER_SIZE];
+  struct timespec wall;
+
+  capture_file = fopen(path, "w");
+  if (!capture_file) {
+    syslog(LOG_ERR, "Failed to create capture file %s: %s", path,
+           strerror(errno));
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &capture_start);
+  clock_gettime(CLOCK_REALTIME, &wall);
+  memcpy(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+  aesd_put_u64(header + CAPTURE_MAGIC_SIZE,
+               (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec);
+  if (fwrite(header, sizeof(header), 1, capture_file) != 1) {
+    syslog(LOG_ERR, "Failed to write capture file: %s", strerror(errno));
+    fclose(capture_file);
+    capture_file = NULL;
+    return -1;
+  }
+  syslog(LOG_INFO, "Capturing traffic to %s", path);
+  return 0;
+}
+
+void capture_close(void) {
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file) {
+    fclose(capture_file);
+    capture_file = NULL;
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_event(enum capture_event type, uint64_t conn_id, bool binary,
+                   const char* data, size_t len) {
+  uint8_t header[CAPTURE_EVENT_HEADER_SIZE];
+  struct timespec now;
+
+  if (!capture_file) {
+    return;
+  }
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file && !write_failed) {
+    // Timestamps are taken under the lock so events are in time order
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed =
+        (uint64_t)(now.tv_sec - capture_start.tv_sec) * 1000000000ULL +
+        now.tv_nsec - capture_start.tv_nsec;
+
+    header[0] = type;
+    header[1] = binary ? CAPTURE_FLAG_BINARY : 0;
+    header[2] = 0;
+    header[3] = 0;
+    aesd_put_u32(header + 4, len);
+    aesd_put_u64(header + 8, conn_id);
+    aesd_put_u64(header + 16, elapsed);
+    if (fwrite(header, sizeof(header), 1, capture_file) != 1 ||
+        (len > 0 && fwrite(data, len, 1, capture_file) != 1)) {
+      // Stop rather than leave a trace with a hole in it
+      syslog(LOG_ERR, "Failed to write capture file, capture stopped: %s",
+             strerror(errno));
+      write_failed = true;
+    } else {
+      events_written++;
+      bytes_written += sizeof(header) + len;
+    }
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_log_stats(void) {
+  if (!capture_file) {
+    return;
+  }
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file) {
+    fflush(capture_file);
+  }
+  syslog(LOG_INFO, "capture: events=%lu bytes=%llu%s", events_written,
+         bytes_written, write_failed ? " (stopped after a write error)" : "");
+  pthread_mutex_unlock(&capture_mutex);
+}
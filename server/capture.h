@@ -0,0 +1,62 @@
+#ifndef AESDSOCKET_CAPTURE_H
+#define AESDSOCKET_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Traffic capture (enabled with --capture <file>), replayed by aesdreplay.
+ *
+ * The trace starts with the 8 byte magic "AESDCAP1" and the capture start
+ * time (u64 ns since the epoch), followed by events, all big endian:
+ *
+ *   byte 0      event type (CAPTURE_*)
+ *   byte 1      flags (CAPTURE_FLAG_*)
+ *   bytes 2-3   reserved, zero
+ *   bytes 4-7   data length
+ *   bytes 8-15  connection id
+ *   bytes 16-23 ns since the capture started
+ *   data
+ *
+ * A connection is opened once its protocol is known (first bytes received)
+ * and closed when the server is done with it. Packet events carry one
+ * inbound newline packet, or one whole binary frame including its header.
+ */
+
+#define CAPTURE_MAGIC "AESDCAP1"
+#define CAPTURE_MAGIC_SIZE 8
+#define CAPTURE_FILE_HEADER_SIZE 16
+#define CAPTURE_EVENT_HEADER_SIZE 24
+
+enum capture_event {
+  CAPTURE_OPEN = 1,
+  CAPTURE_PACKET = 2,
+  CAPTURE_CLOSE = 3,
+};
+
+#define CAPTURE_FLAG_BINARY 0x01  // the connection uses aesd_protocol.h
+
+/**
+ * Create the trace file. Call before any connection is accepted.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int capture_open(const char* path);
+
+/**
+ * Flush and close the trace file.
+ */
+void capture_close(void);
+
+/**
+ * Append one event; a no-op when no capture is running.
+ */
+void capture_event(enum capture_event type, uint64_t conn_id, bool binary,
+                   const char* data, size_t len);
+
+/**
+ * Log the number of captured events and bytes to syslog.
+ */
+void capture_log_stats(void);
+
+#endif /* AESDSOCKET_CAPTURE_H */
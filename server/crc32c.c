@@ -0,0 +1,106 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // reflected Castagnoli polynomial
+
+static uint32_t table[8][256];
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t*, size_t);
+static const char* impl_name;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Software fallback: eight table lookups per 8 input bytes
+static uint32_t crc32c_slice8(uint32_t crc, const uint8_t* p, size_t len) {
+  while (len > 0 && ((uintptr_t)p & 7)) {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap32(lo);
+    hi = __builtin_bswap32(hi);
+#endif
+    lo ^= crc;
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+          table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+          table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+          table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+// One crc32 instruction per 8 input bytes
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(
+    uint32_t crc, const uint8_t* p, size_t len) {
+  uint64_t crc64;
+
+  while (len > 0 && ((uintptr_t)p & 7)) {
+    crc = _mm_crc32_u8(crc, *p++);
+    len--;
+  }
+  crc64 = crc;
+  while (len >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (len > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    len--;
+  }
+  return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    }
+    table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int slice = 1; slice < 8; slice++) {
+      table[slice][i] =
+          table[0][table[slice - 1][i] & 0xff] ^ (table[slice - 1][i] >> 8);
+    }
+  }
+
+  crc32c_fn = crc32c_slice8;
+  impl_name = "slice-by-8";
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_fn = crc32c_sse42;
+    impl_name = "sse4.2";
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+  pthread_once(&init_once, crc32c_init);
+  return ~crc32c_fn(~crc, data, len);
+}
+
+const char* crc32c_impl(void) {
+  pthread_once(&init_once, crc32c_init);
+  return impl_name;
+}
@@ -0,0 +1,19 @@
+#ifndef AESDSOCKET_CRC32C_H
+#define AESDSOCKET_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Extend a CRC32C (Castagnoli) checksum with len bytes of data; start with
+ * crc 0. Uses the SSE4.2 crc32 instruction when the CPU has it and a
+ * slice-by-8 table implementation otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+/**
+ * Name of the implementation in use ("sse4.2" or "slice-by-8").
+ */
+const char* crc32c_impl(void);
+
+#endif /* AESDSOCKET_CRC32C_H */
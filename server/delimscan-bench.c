@@ -0,0 +1,170 @@
+/**
+ * @file delimscan-bench.c
+ * @brief Measure the delimscan kernels against memchr() and strchr() on a
+ * buffer of newline-terminated lines.
+ *
+ * Usage: delimscan-bench [-s size_mb] [-l line_len] [-i iterations]
+ *
+ * Every implementation the CPU supports is timed finding each newline in
+ * turn (as packet framing does), counting them and indexing them in
+ * batches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "delimscan.h"
+
+#define INDEX_BATCH 256
+
+static const char* impls[] = {"avx2", "sse2", "neon", "scalar"};
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t walk_memchr(const char* data, size_t len) {
+  size_t lines = 0;
+  const char* p = data;
+  const char* newline;
+  while ((newline = memchr(p, '\n', len - (p - data)))) {
+    lines++;
+    p = newline + 1;
+  }
+  return lines;
+}
+
+static size_t walk_strchr(const char* data, size_t len) {
+  size_t lines = 0;
+  const char* newline;
+  while ((newline = strchr(data, '\n'))) {
+    lines++;
+    data = newline + 1;
+  }
+  return lines;
+}
+
+static size_t walk_find(const char* data, size_t len) {
+  size_t lines = 0;
+  const char* p = data;
+  const char* newline;
+  while ((newline = delimscan_find(p, len - (p - data), '\n'))) {
+    lines++;
+    p = newline + 1;
+  }
+  return lines;
+}
+
+static size_t walk_count(const char* data, size_t len) {
+  return delimscan_count(data, len, '\n');
+}
+
+static size_t walk_index(const char* data, size_t len) {
+  size_t positions[INDEX_BATCH];
+  size_t lines = 0, start = 0, found;
+  do {
+    found = delimscan_index(data + start, len - start, '\n', positions,
+                            INDEX_BATCH);
+    lines += found;
+    if (found > 0) {
+      start += positions[found - 1] + 1;
+    }
+  } while (found == INDEX_BATCH);
+  return lines;
+}
+
+// Best of iterations, in GB/s; exits if the line count is wrong
+static double measure(const char* name, size_t (*walk)(const char*, size_t),
+                      const char* data, size_t len, size_t lines,
+                      int iterations) {
+  double best = 0;
+  for (int i = 0; i < iterations; i++) {
+    double start = now_s();
+    size_t counted = walk(data, len);
+    double elapsed = now_s() - start;
+    if (counted != lines) {
+      fprintf(stderr, "%s: counted %zu lines, expected %zu\n", name, counted,
+              lines);
+      exit(1);
+    }
+    if (0 == i || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return len / best / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+  size_t size_mb = 16;
+  size_t line_len = 64;
+  int iterations = 10;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:l:i:")) != -1) {
+    switch (opt) {
+      case 's':
+        size_mb = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        line_len = strtoul(optarg, NULL, 10);
+        break;
+      case 'i':
+        iterations = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-s size_mb] [-l line_len] [-i iterations]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (0 == size_mb || 0 == line_len || iterations <= 0) {
+    fprintf(stderr, "size, line length and iterations must be positive\n");
+    return 1;
+  }
+
+  // Lines of random length around line_len, NUL-terminated for strchr()
+  size_t len = size_mb * 1024 * 1024;
+  char* data = malloc(len + 1);
+  if (!data) {
+    perror("malloc");
+    return 1;
+  }
+  size_t lines = 0;
+  srand(1);
+  for (size_t pos = 0; pos < len;) {
+    size_t line = 1 + rand() % (2 * line_len);
+    for (size_t i = 0; i + 1 < line && pos < len; i++) {
+      data[pos++] = 'a' + rand() % 26;
+    }
+    if (pos < len) {
+      data[pos++] = '\n';
+      lines++;
+    }
+  }
+  data[len] = '\0';
+
+  printf("%zu MiB, %zu lines, detected implementation %s\n", size_mb, lines,
+         delimscan_impl());
+  printf("%-8s %8s %10.2f GB/s\n", "libc", "memchr",
+         measure("memchr", walk_memchr, data, len, lines, iterations));
+  printf("%-8s %8s %10.2f GB/s\n", "libc", "strchr",
+         measure("strchr", walk_strchr, data, len, lines, iterations));
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (delimscan_select(impls[i]) < 0) {
+      continue;
+    }
+    printf("%-8s %8s %10.2f GB/s\n", impls[i], "find",
+           measure("find", walk_find, data, len, lines, iterations));
+    printf("%-8s %8s %10.2f GB/s\n", impls[i], "count",
+           measure("count", walk_count, data, len, lines, iterations));
+    printf("%-8s %8s %10.2f GB/s\n", impls[i], "index",
+           measure("index", walk_index, data, len, lines, iterations));
+  }
+  free(data);
+  return 0;
+}
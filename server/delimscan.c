@@ -0,0 +1,214 @@
+#include "delimscan.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+struct delimscan_ops {
+  const char* name;
+  const char* (*find)(const char*, size_t, char);
+  size_t (*count)(const char*, size_t, char);
+  size_t (*index)(const char*, size_t, char, size_t*, size_t);
+};
+
+static const struct delimscan_ops* ops;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// Byte loops for whatever is left after the last full block
+static const char* find_tail(const char* p, size_t len, char delim) {
+  return memchr(p, delim, len);
+}
+
+static size_t count_tail(const char* p, size_t len, char delim) {
+  size_t count = 0;
+  for (size_t i = 0; i < len; i++) {
+    count += p[i] == delim;
+  }
+  return count;
+}
+
+static size_t index_tail(const char* p, size_t len, char delim, size_t base,
+                         size_t* positions, size_t max) {
+  size_t found = 0;
+  for (size_t i = 0; i < len && found < max; i++) {
+    if (p[i] == delim) {
+      positions[found++] = base + i;
+    }
+  }
+  return found;
+}
+
+// Stamp out find/count/index for a kernel. SETUP prepares the delimiter
+// pattern, MASK(p) turns BLOCK bytes at p into a bit mask of the delimiter
+// positions with one set bit per match, byte i owning bit (i << SHIFT) +
+// (1 << SHIFT) - 1 or, for SHIFT 0, bit i.
+#define DELIMSCAN_KERNELS(suffix, attr, BLOCK, SHIFT, SETUP, MASK)            \
+  attr static const char* find_##suffix(const char* p, size_t len,            \
+                                        char delim) {                         \
+    SETUP;                                                                    \
+    size_t i = 0;                                                             \
+    for (; i + (BLOCK) <= len; i += (BLOCK)) {                                \
+      uint64_t mask = MASK(p + i);                                            \
+      if (mask) {                                                             \
+        return p + i + (__builtin_ctzll(mask) >> (SHIFT));                    \
+      }                                                                       \
+    }                                                                         \
+    return find_tail(p + i, len - i, delim);                                  \
+  }                                                                           \
+                                                                              \
+  attr static size_t count_##suffix(const char* p, size_t len, char delim) {  \
+    SETUP;                                                                    \
+    size_t count = 0, i = 0;                                                  \
+    for (; i + (BLOCK) <= len; i += (BLOCK)) {                                \
+      count += __builtin_popcountll(MASK(p + i));                             \
+    }                                                                         \
+    return count + count_tail(p + i, len - i, delim);                         \
+  }                                                                           \
+                                                                              \
+  attr static size_t index_##suffix(const char* p, size_t len, char delim,    \
+                                    size_t* positions, size_t max) {          \
+    SETUP;                                                                    \
+    size_t found = 0, i = 0;                                                  \
+    for (; i + (BLOCK) <= len; i += (BLOCK)) {                                \
+      uint64_t mask = MASK(p + i);                                            \
+      while (mask) {                                                          \
+        if (found == max) {                                                   \
+          return found;                                                       \
+        }                                                                     \
+        positions[found++] = i + (__builtin_ctzll(mask) >> (SHIFT));          \
+        mask &= mask - 1;                                                     \
+      }                                                                       \
+    }                                                                         \
+    return found + index_tail(p + i, len - i, delim, i, positions + found,    \
+                              max - found);                                   \
+  }
+
+// Scalar: eight bytes per step. The exact zero-byte test below sets the top
+// bit of every byte equal to delim (no false positives from borrows).
+#define SWAR_LOW7 0x7f7f7f7f7f7f7f7full
+
+static inline uint64_t swar_load(const char* p) {
+  uint64_t word;
+  memcpy(&word, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);  // byte 0 in the low bits
+#endif
+  return word;
+}
+
+static inline uint64_t swar_mask(uint64_t word, uint64_t pattern) {
+  uint64_t x = word ^ pattern;
+  return ~(((x & SWAR_LOW7) + SWAR_LOW7) | x | SWAR_LOW7);
+}
+
+#define SCALAR_SETUP uint64_t pattern = 0x0101010101010101ull * (uint8_t)delim
+#define SCALAR_MASK(q) swar_mask(swar_load(q), pattern)
+DELIMSCAN_KERNELS(scalar, , 8, 3, SCALAR_SETUP, SCALAR_MASK)
+
+static const struct delimscan_ops scalar_ops = {
+    "scalar", find_scalar, count_scalar, index_scalar};
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, AVX2 is checked at runtime
+#define SSE2_SETUP __m128i pattern = _mm_set1_epi8(delim)
+#define SSE2_MASK(q)                                                         \
+  (uint64_t)(uint32_t)_mm_movemask_epi8(                                     \
+      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(q)), pattern))
+DELIMSCAN_KERNELS(sse2, , 16, 0, SSE2_SETUP, SSE2_MASK)
+
+#define AVX2_SETUP __m256i pattern = _mm256_set1_epi8(delim)
+#define AVX2_MASK(q)                                                         \
+  (uint64_t)(uint32_t)_mm256_movemask_epi8(                                  \
+      _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(q)), pattern))
+DELIMSCAN_KERNELS(avx2, __attribute__((target("avx2"))), 32, 0, AVX2_SETUP,
+                  AVX2_MASK)
+
+static const struct delimscan_ops simd_ops[] = {
+    {"avx2", find_avx2, count_avx2, index_avx2},
+    {"sse2", find_sse2, count_sse2, index_sse2},
+};
+#elif defined(__aarch64__)
+// NEON has no movemask: narrowing the 0xff/0x00 compare result by 4 bits
+// leaves a nibble per byte, of which the top bit is kept
+static inline uint64_t neon_mask(const char* q, uint8x16_t pattern) {
+  uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t*)q), pattern);
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) &
+         0x8888888888888888ull;
+}
+
+#define NEON_SETUP uint8x16_t pattern = vdupq_n_u8((uint8_t)delim)
+#define NEON_MASK(q) neon_mask(q, pattern)
+DELIMSCAN_KERNELS(neon, , 16, 2, NEON_SETUP, NEON_MASK)
+
+static const struct delimscan_ops simd_ops[] = {
+    {"neon", find_neon, count_neon, index_neon},
+};
+#endif
+
+static bool supported(const struct delimscan_ops* candidate) {
+#if defined(__x86_64__)
+  if (0 == strcmp(candidate->name, "avx2")) {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return true;
+}
+
+static void delimscan_init(void) {
+  ops = &scalar_ops;
+#if defined(__x86_64__) || defined(__aarch64__)
+  // Fastest first
+  for (size_t i = 0; i < sizeof(simd_ops) / sizeof(simd_ops[0]); i++) {
+    if (supported(&simd_ops[i])) {
+      ops = &simd_ops[i];
+      break;
+    }
+  }
+#endif
+}
+
+const char* delimscan_find(const char* data, size_t len, char delim) {
+  pthread_once(&init_once, delimscan_init);
+  return ops->find(data, len, delim);
+}
+
+size_t delimscan_count(const char* data, size_t len, char delim) {
+  pthread_once(&init_once, delimscan_init);
+  return ops->count(data, len, delim);
+}
+
+size_t delimscan_index(const char* data, size_t len, char delim,
+                       size_t* positions, size_t max) {
+  pthread_once(&init_once, delimscan_init);
+  return ops->index(data, len, delim, positions, max);
+}
+
+const char* delimscan_impl(void) {
+  pthread_once(&init_once, delimscan_init);
+  return ops->name;
+}
+
+int delimscan_select(const char* impl) {
+  pthread_once(&init_once, delimscan_init);
+  if (0 == strcmp(impl, scalar_ops.name)) {
+    ops = &scalar_ops;
+    return 0;
+  }
+#if defined(__x86_64__) || defined(__aarch64__)
+  for (size_t i = 0; i < sizeof(simd_ops) / sizeof(simd_ops[0]); i++) {
+    if (0 == strcmp(impl, simd_ops[i].name) && supported(&simd_ops[i])) {
+      ops = &simd_ops[i];
+      return 0;
+    }
+  }
+#endif
+  return -1;
+}
@@ -0,0 +1,45 @@
+#ifndef AESDSOCKET_DELIMSCAN_H
+#define AESDSOCKET_DELIMSCAN_H
+
+#include <stddef.h>
+
+/**
+ * Delimiter scanning for the newline framing shared by aesdsocket and the
+ * client tools. Every function looks at 16 or 32 bytes per step with SSE2,
+ * AVX2 or NEON compares, picked at first use from what the CPU supports,
+ * and falls back to a word-at-a-time scalar loop elsewhere.
+ */
+
+/**
+ * Find the first delim in data[0, len).
+ * @return a pointer to it, or NULL if there is none
+ */
+const char* delimscan_find(const char* data, size_t len, char delim);
+
+/**
+ * @return the number of delim bytes in data[0, len)
+ */
+size_t delimscan_count(const char* data, size_t len, char delim);
+
+/**
+ * Store the offsets of the first max delimiters in data[0, len) into
+ * positions, in increasing order.
+ * @return the number of offsets stored; fewer than max means the whole
+ * range was scanned
+ */
+size_t delimscan_index(const char* data, size_t len, char delim,
+                       size_t* positions, size_t max);
+
+/**
+ * Name of the implementation in use ("avx2", "sse2", "neon" or "scalar").
+ */
+const char* delimscan_impl(void);
+
+/**
+ * Use the named implementation instead of the detected one, e.g. to compare
+ * them in a benchmark.
+ * @return 0 on success, -1 if it is unknown or the CPU lacks it
+ */
+int delimscan_select(const char* impl);
+
+#endif /* AESDSOCKET_DELIMSCAN_H */
@@ -0,0 +1,262 @@
+#include "durability.h"
+#include "probes.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_GROUP_INTERVAL_MS 10
+// Longest group interval accepted; its microseconds fit a useconds_t
+#define MAX_GROUP_INTERVAL_MS 60000
+
+static enum durability_mode mode = DURABILITY_NONE;
+static long group_interval_ms = DEFAULT_GROUP_INTERVAL_MS;
+static int sync_fd = -1;
+static pthread_t syncer_thread;
+static bool syncer_running = false;
+
+// Sequence numbers of appended and synced packets, protected by sync_mutex.
+// written_seq - synced_seq is the pending-sync depth.
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_needed = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static unsigned long written_seq = 0;
+static unsigned long synced_seq = 0;
+static bool stopping = false;
+
+// Tickets in (failed_from, failed_to] were covered by a failed (or skipped)
+// fdatasync and must not be acknowledged as durable. Failed ranges are merged
+// into one, so after several failures tickets synced in between are refused
+// too; protected by sync_mutex.
+static unsigned long failed_from = 0;
+static unsigned long failed_to = 0;
+
+// Sync latency statistics, protected by sync_mutex
+static unsigned long sync_count = 0;
+static unsigned long long sync_total_ns = 0;
+static unsigned long long sync_max_ns = 0;
+static unsigned long max_pending = 0;
+static unsigned long sync_failures = 0;
+
+static const char* mode_names[] = {
+    [DURABILITY_NONE] = "none",
+    [DURABILITY_PACKET] = "packet",
+    [DURABILITY_GROUP] = "group",
+    [DURABILITY_ACK] = "ack",
+};
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Record that tickets (from, to] were not made durable. Caller holds
+// sync_mutex.
+static void mark_failed(unsigned long from, unsigned long to) {
+  if (failed_from == failed_to || from < failed_from) {
+    failed_from = from;
+  }
+  if (to > failed_to) {
+    failed_to = to;
+  }
+  sync_failures++;
+}
+
+// fdatasync() the file and account for its latency.
+// Returns 0 on success, -1 if the sync failed (logged).
+static int sync_file(void) {
+  unsigned long long start = now_ns();
+  int retval = 0;
+  if (fdatasync(sync_fd) < 0) {
+    syslog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+    retval = -1;
+  }
+  unsigned long long elapsed = now_ns() - start;
+  AESD_PROBE1(fdatasync, elapsed);
+
+  pthread_mutex_lock(&sync_mutex);
+  sync_count++;
+  sync_total_ns += elapsed;
+  if (elapsed > sync_max_ns) {
+    sync_max_ns = elapsed;
+  }
+  pthread_mutex_unlock(&sync_mutex);
+  return retval;
+}
+
+// Background syncer: in group mode it wakes every group_interval_ms, in ack
+// mode as soon as a packet is pending. Either way one fdatasync covers every
+// packet written before it started.
+static void* syncer(void* arg) {
+  pthread_mutex_lock(&sync_mutex);
+  while (!stopping) {
+    if (written_seq == synced_seq) {
+      if (DURABILITY_GROUP == mode) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += group_interval_ms / 1000;
+        deadline.tv_nsec += group_interval_ms % 1000 * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&sync_needed, &sync_mutex, &deadline);
+      } else {
+        pthread_cond_wait(&sync_needed, &sync_mutex);
+      }
+      continue;
+    }
+
+    unsigned long target = written_seq;
+    pthread_mutex_unlock(&sync_mutex);
+    int result = sync_file();
+    pthread_mutex_lock(&sync_mutex);
+    if (result < 0) {
+      mark_failed(synced_seq, target);
+    }
+    synced_seq = target;
+    pthread_cond_broadcast(&sync_done);
+
+    if (DURABILITY_GROUP == mode && !stopping) {
+      // Let the next interval's packets accumulate
+      pthread_mutex_unlock(&sync_mutex);
+      usleep(group_interval_ms * 1000);
+      pthread_mutex_lock(&sync_mutex);
+    }
+  }
+  // Release anyone still waiting for an ack, without acknowledging the data
+  if (written_seq != synced_seq) {
+    mark_failed(synced_seq, written_seq);
+  }
+  synced_seq = written_seq;
+  pthread_cond_broadcast(&sync_done);
+  pthread_mutex_unlock(&sync_mutex);
+  return NULL;
+}
+
+int durability_configure(const char* spec) {
+  if (0 == strcmp(spec, "none")) {
+    mode = DURABILITY_NONE;
+  } else if (0 == strcmp(spec, "packet")) {
+    mode = DURABILITY_PACKET;
+  } else if (0 == strcmp(spec, "ack")) {
+    mode = DURABILITY_ACK;
+  } else if (0 == strncmp(spec, "group", 5) &&
+             ('\0' == spec[5] || ':' == spec[5])) {
+    mode = DURABILITY_GROUP;
+    if (':' == spec[5]) {
+      char* end;
+      errno = 0;
+      group_interval_ms = strtol(spec + 6, &end, 10);
+      if (end == spec + 6 || *end != '\0' || errno != 0 ||
+          group_interval_ms <= 0 || group_interval_ms > MAX_GROUP_INTERVAL_MS) {
+        return -1;
+      }
+    }
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int durability_start(const char* path) {
+  if (DURABILITY_NONE == mode) {
+    return 0;
+  }
+
+  sync_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (sync_fd < 0) {
+    syslog(LOG_ERR, "Failed to open %s for syncing: %s", path, strerror(errno));
+    return -1;
+  }
+
+  if (DURABILITY_GROUP == mode || DURABILITY_ACK == mode) {
+    if (pthread_create(&syncer_thread, NULL, syncer, NULL) != 0) {
+      syslog(LOG_ERR, "Failed to create syncer thread");
+      close(sync_fd);
+      sync_fd = -1;
+      return -1;
+    }
+    syncer_running = true;
+  }
+  syslog(LOG_INFO, "Durability mode: %s", mode_names[mode]);
+  return 0;
+}
+
+void durability_stop(void) {
+  if (syncer_running) {
+    pthread_mutex_lock(&sync_mutex);
+    stopping = true;
+    pthread_cond_signal(&sync_needed);
+    pthread_mutex_unlock(&sync_mutex);
+    pthread_join(syncer_thread, NULL);
+    syncer_running = false;
+  }
+  if (sync_fd >= 0) {
+    close(sync_fd);
+    sync_fd = -1;
+  }
+}
+
+unsigned long durability_after_append(void) {
+  unsigned long ticket;
+
+  if (DURABILITY_NONE == mode) {
+    return 0;
+  }
+  if (DURABILITY_PACKET == mode) {
+    // Inline: storage operations are serialised, so this also orders against
+    // other writers
+    int result = sync_file();
+    pthread_mutex_lock(&sync_mutex);
+    ticket = ++written_seq;
+    if (result < 0) {
+      mark_failed(ticket - 1, ticket);
+    }
+    synced_seq = ticket;
+    pthread_mutex_unlock(&sync_mutex);
+    return ticket;
+  }
+
+  pthread_mutex_lock(&sync_mutex);
+  ticket = ++written_seq;
+  if (written_seq - synced_seq > max_pending) {
+    max_pending = written_seq - synced_seq;
+  }
+  if (DURABILITY_ACK == mode) {
+    pthread_cond_signal(&sync_needed);
+  }
+  pthread_mutex_unlock(&sync_mutex);
+  return ticket;
+}
+
+int durability_wait(unsigned long ticket) {
+  int retval;
+
+  if (mode != DURABILITY_ACK && mode != DURABILITY_PACKET) {
+    return 0;
+  }
+  pthread_mutex_lock(&sync_mutex);
+  while (synced_seq < ticket) {
+    pthread_cond_wait(&sync_done, &sync_mutex);
+  }
+  retval = ticket > failed_from && ticket <= failed_to ? -1 : 0;
+  pthread_mutex_unlock(&sync_mutex);
+  return retval;
+}
+
+void durability_log_stats(void) {
+  pthread_mutex_lock(&sync_mutex);
+  syslog(LOG_INFO,
+         "durability: mode=%s syncs=%lu avg_latency_us=%llu "
+         "max_latency_us=%llu pending=%lu max_pending=%lu failures=%lu",
+         mode_names[mode], sync_count,
+         sync_count ? sync_total_ns / sync_count / 1000 : 0,
+         sync_max_ns / 1000, written_seq - synced_seq, max_pending,
+         sync_failures);
+  pthread_mutex_unlock(&sync_mutex);
+}
@@ -0,0 +1,56 @@
+#ifndef AESDSOCKET_DURABILITY_H
+#define AESDSOCKET_DURABILITY_H
+
+#include <stdbool.h>
+
+/**
+ * How appended packets are made durable before/after they are acknowledged
+ * (i.e. before the replay is sent back to the client).
+ */
+enum durability_mode {
+  DURABILITY_NONE,    // fflush only, the page cache decides when to write back
+  DURABILITY_PACKET,  // fdatasync after every packet, inline with the write
+  DURABILITY_GROUP,   // background fdatasync every N ms if anything changed
+  DURABILITY_ACK,     // clients wait for a (batched) fdatasync before the ack
+};
+
+/**
+ * Parse a mode spec: "none", "packet", "group[:<ms>]" or "ack". The group
+ * interval is a whole number of milliseconds from 1 to 60000.
+ * @return 0 on success, -1 if the spec is not recognised
+ */
+int durability_configure(const char* spec);
+
+/**
+ * Open path for syncing and start the background syncer thread when the
+ * configured mode needs one.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int durability_start(const char* path);
+
+/**
+ * Stop the syncer thread, releasing any waiting clients, and close the file.
+ */
+void durability_stop(void);
+
+/**
+ * Record that a packet has just been written and flushed to the file.
+ * Must be called from the storage operation, right after the write.
+ * @return a ticket to pass to durability_wait()
+ */
+unsigned long durability_after_append(void);
+
+/**
+ * In ack mode, block until the data covered by ticket has been synced.
+ * Returns immediately in every other mode. Call outside storage operations.
+ * @return 0 if the data may be acknowledged, -1 in ack and packet mode if
+ *         the fdatasync covering it failed (or the syncer stopped first)
+ */
+int durability_wait(unsigned long ticket);
+
+/**
+ * Log sync latency and pending-sync depth to syslog.
+ */
+void durability_log_stats(void);
+
+#endif /* AESDSOCKET_DURABILITY_H */
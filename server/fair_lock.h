@@ -0,0 +1,43 @@
+#ifndef AESDSOCKET_FAIR_LOCK_H
+#define AESDSOCKET_FAIR_LOCK_H
+
+#include <pthread.h>
+
+/*
+ * FIFO ticket lock. pthread mutexes make no fairness promise, so a client
+ * that re-acquires in a tight loop can starve the others. Here waiters are
+ * served strictly in arrival order; with one thread per connection and one
+ * packet in flight per thread, that is round-robin across connections.
+ */
+struct fair_lock {
+  pthread_mutex_t mutex;
+  pthread_cond_t turn;
+  unsigned long next_ticket;
+  unsigned long now_serving;
+};
+
+#define FAIR_LOCK_INITIALIZER \
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 }
+
+static inline void fair_lock_acquire(struct fair_lock* lock) {
+  pthread_mutex_lock(&lock->mutex);
+  unsigned long ticket = lock->next_ticket++;
+  while (ticket != lock->now_serving) {
+    pthread_cond_wait(&lock->turn, &lock->mutex);
+  }
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline void fair_lock_release(struct fair_lock* lock) {
+  pthread_mutex_lock(&lock->mutex);
+  lock->now_serving++;
+  pthread_cond_broadcast(&lock->turn);
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline void fair_lock_destroy(struct fair_lock* lock) {
+  pthread_mutex_destroy(&lock->mutex);
+  pthread_cond_destroy(&lock->turn);
+}
+
+#endif /* AESDSOCKET_FAIR_LOCK_H */
@@ -0,0 +1,59 @@
+#define _GNU_SOURCE  // memmem, REG_STARTEND
+
+#include "grep.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+int grep_compile(struct grep_matcher* matcher, const char* pattern,
+                 size_t len) {
+  memset(matcher, 0, sizeof(*matcher));
+  matcher->pattern = malloc(len + 1);
+  if (!matcher->pattern) {
+    return -1;
+  }
+  memcpy(matcher->pattern, pattern, len);
+  matcher->pattern[len] = '\0';
+  matcher->len = len;
+
+  // glibc's memmem() is a vectorised two-way search, far cheaper than
+  // running the regex engine over every record
+  matcher->literal = strcspn(matcher->pattern, ".[]()*+?{}|^$\\") == len &&
+                     strlen(matcher->pattern) == len;
+  if (matcher->literal) {
+    return 0;
+  }
+
+  int err = regcomp(&matcher->regex, matcher->pattern, REG_EXTENDED | REG_NOSUB);
+  if (err != 0) {
+    char message[128];
+    regerror(err, &matcher->regex, message, sizeof(message));
+    syslog(LOG_ERR, "Invalid grep pattern '%s': %s", matcher->pattern, message);
+    free(matcher->pattern);
+    matcher->pattern = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+bool grep_match(const struct grep_matcher* matcher, const char* line,
+                size_t len) {
+  if (matcher->literal) {
+    return memmem(line, len, matcher->pattern, matcher->len) != NULL;
+  }
+  if (len > 0 && '\n' == line[len - 1]) {
+    len--;  // keep '$' anchored at the end of the record
+  }
+  // REG_STARTEND matches in place, without NUL-terminating a copy
+  regmatch_t range = {.rm_so = 0, .rm_eo = len};
+  return 0 == regexec(&matcher->regex, line, 1, &range, REG_STARTEND);
+}
+
+void grep_free(struct grep_matcher* matcher) {
+  if (matcher->pattern && !matcher->literal) {
+    regfree(&matcher->regex);
+  }
+  free(matcher->pattern);
+  matcher->pattern = NULL;
+}
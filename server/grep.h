@@ -0,0 +1,34 @@
+#ifndef AESDSOCKET_GREP_H
+#define AESDSOCKET_GREP_H
+
+#include <regex.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Line matcher for AESDCHAR_GREP. Patterns without regex metacharacters
+ * are searched for as plain strings with memmem(); anything else is a
+ * POSIX extended regular expression.
+ */
+struct grep_matcher {
+  bool literal;
+  char* pattern;
+  size_t len;
+  regex_t regex;
+};
+
+/**
+ * Prepare matcher for pattern (len bytes, not NUL-terminated).
+ * @return 0 on success, -1 if the pattern is not a valid regex (logged)
+ */
+int grep_compile(struct grep_matcher* matcher, const char* pattern, size_t len);
+
+/**
+ * Whether the record line[0..len) matches.
+ */
+bool grep_match(const struct grep_matcher* matcher, const char* line,
+                size_t len);
+
+void grep_free(struct grep_matcher* matcher);
+
+#endif /* AESDSOCKET_GREP_H */
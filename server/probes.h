@@ -0,0 +1,26 @@
+#ifndef AESDSOCKET_PROBES_H
+#define AESDSOCKET_PROBES_H
+
+/*
+ * USDT tracepoints for aesdsocket (provider "aesdsocket").
+ *
+ * With <sys/sdt.h> available (systemtap-sdt-dev) each probe compiles to a
+ * single nop plus an ELF note, so it costs nothing until perf, bpftrace or
+ * systemtap attaches to it. Without the header the probes compile away.
+ *
+ * Every per-connection probe carries the connection id as its first
+ * argument; see README.md for the list of probes.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define AESD_PROBE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define AESD_PROBE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#define AESD_PROBE3(name, a, b, c) DTRACE_PROBE3(aesdsocket, name, a, b, c)
+#else
+#define AESD_PROBE1(name, a) do { } while (0)
+#define AESD_PROBE2(name, a, b) do { } while (0)
+#define AESD_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /* AESDSOCKET_PROBES_H */
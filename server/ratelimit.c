@@ -0,0 +1,265 @@
+#include "ratelimit.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#define SOURCE_HASH_SIZE 256
+#define SOURCE_KEY_SIZE 64
+
+// Shared limit for all connections from one source, refcounted by them. It
+// is kept after the last connection closes until its buckets have refilled,
+// so that reconnecting doesn't start over with a full bucket.
+struct ratelimit_source {
+  struct rate_limit limit;
+  char key[SOURCE_KEY_SIZE];
+  int refs;  // protected by sources_mutex
+  struct ratelimit_source* next;
+};
+
+// Configured rates; 0 means unlimited
+static double conn_pps = 0, conn_bps = 0;
+static double source_pps = 0, source_bps = 0;
+
+static pthread_mutex_t sources_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ratelimit_source* sources[SOURCE_HASH_SIZE];
+static unsigned long source_count = 0;
+static double last_sweep = 0;  // protected by sources_mutex
+
+// Seconds between sweeps for unused sources
+#define SOURCE_SWEEP_INTERVAL 1.0
+
+// Throttle counters, protected by stats_mutex
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long packets_charged = 0;
+static unsigned long packets_throttled = 0;
+static double throttled_seconds = 0;
+static double max_throttle_seconds = 0;
+
+// Throttle sleeps wait on throttle_wake so that shutdown can cut them short
+static pthread_mutex_t throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t throttle_wake = PTHREAD_COND_INITIALIZER;
+static bool throttle_stopping = false;
+
+static double now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bucket_init(struct token_bucket* bucket, double rate) {
+  bucket->rate = rate;
+  bucket->burst = rate;  // one second worth of traffic
+  bucket->tokens = rate;
+  bucket->last = now_s();
+}
+
+// Refill, take cost tokens and return how long the caller must wait
+static double bucket_charge(struct token_bucket* bucket, double cost,
+                            double now) {
+  if (0 == bucket->rate) {
+    return 0;
+  }
+  bucket->tokens += (now - bucket->last) * bucket->rate;
+  if (bucket->tokens > bucket->burst) {
+    bucket->tokens = bucket->burst;
+  }
+  bucket->last = now;
+  bucket->tokens -= cost;
+  return bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
+
+// Time at which the bucket is full again if nothing is charged meanwhile
+static double bucket_full_at(const struct token_bucket* bucket) {
+  if (0 == bucket->rate) {
+    return 0;
+  }
+  return bucket->last + (bucket->burst - bucket->tokens) / bucket->rate;
+}
+
+static void limit_init(struct rate_limit* limit, double pps, double bps) {
+  pthread_mutex_init(&limit->lock, NULL);
+  bucket_init(&limit->packets, pps);
+  bucket_init(&limit->bytes, bps);
+}
+
+static double limit_charge(struct rate_limit* limit, size_t bytes, double now) {
+  pthread_mutex_lock(&limit->lock);
+  double packet_wait = bucket_charge(&limit->packets, 1, now);
+  double byte_wait = bucket_charge(&limit->bytes, bytes, now);
+  pthread_mutex_unlock(&limit->lock);
+  return packet_wait > byte_wait ? packet_wait : byte_wait;
+}
+
+int ratelimit_configure(const char* spec, bool per_source) {
+  double pps, bps;
+  char extra;
+
+  if (sscanf(spec, "%lf:%lf%c", &pps, &bps, &extra) != 2 || pps < 0 ||
+      bps < 0) {
+    return -1;
+  }
+  if (per_source) {
+    source_pps = pps;
+    source_bps = bps;
+  } else {
+    conn_pps = pps;
+    conn_bps = bps;
+  }
+  return 0;
+}
+
+void ratelimit_conn_init(struct rate_limit* limit) {
+  limit_init(limit, conn_pps, conn_bps);
+}
+
+void ratelimit_conn_destroy(struct rate_limit* limit) {
+  pthread_mutex_destroy(&limit->lock);
+}
+
+// djb2 string hash
+static unsigned hash_key(const char* key) {
+  unsigned hash = 5381;
+  while (*key) {
+    hash = hash * 33 + (unsigned char)*key++;
+  }
+  return hash % SOURCE_HASH_SIZE;
+}
+
+// Forget the sources without connections whose buckets have refilled: a new
+// limit for them would start out the same. Called with sources_mutex held.
+static void sweep_sources(double now) {
+  struct ratelimit_source** link;
+  struct ratelimit_source* source;
+  unsigned slot;
+
+  if (now - last_sweep < SOURCE_SWEEP_INTERVAL) {
+    return;
+  }
+  last_sweep = now;
+  for (slot = 0; slot < SOURCE_HASH_SIZE; slot++) {
+    link = &sources[slot];
+    while ((source = *link)) {
+      // Unused sources aren't charged, so their buckets need no lock
+      if (0 == source->refs &&
+          now >= bucket_full_at(&source->limit.packets) &&
+          now >= bucket_full_at(&source->limit.bytes)) {
+        *link = source->next;
+        source_count--;
+        pthread_mutex_destroy(&source->limit.lock);
+        free(source);
+      } else {
+        link = &source->next;
+      }
+    }
+  }
+}
+
+struct ratelimit_source* ratelimit_source_get(const char* key) {
+  struct ratelimit_source* source;
+  unsigned slot = hash_key(key);
+
+  if (0 == source_pps && 0 == source_bps) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&sources_mutex);
+  sweep_sources(now_s());
+  for (source = sources[slot]; source; source = source->next) {
+    if (0 == strcmp(source->key, key)) {
+      break;
+    }
+  }
+  if (!source) {
+    source = calloc(1, sizeof(*source));
+    if (source) {
+      limit_init(&source->limit, source_pps, source_bps);
+      snprintf(source->key, sizeof(source->key), "%s", key);
+      source->next = sources[slot];
+      sources[slot] = source;
+      source_count++;
+    } else {
+      syslog(LOG_ERR, "Failed to allocate rate limit for %s", key);
+    }
+  }
+  if (source) {
+    source->refs++;
+  }
+  pthread_mutex_unlock(&sources_mutex);
+  return source;
+}
+
+void ratelimit_source_put(struct ratelimit_source* source) {
+  if (!source) {
+    return;
+  }
+  // The source stays until a sweep finds its buckets refilled
+  pthread_mutex_lock(&sources_mutex);
+  source->refs--;
+  pthread_mutex_unlock(&sources_mutex);
+}
+
+void ratelimit_throttle(struct rate_limit* conn, struct ratelimit_source* source,
+                        size_t bytes) {
+  double now = now_s();
+  double wait = limit_charge(conn, bytes, now);
+
+  if (source) {
+    double source_wait = limit_charge(&source->limit, bytes, now);
+    if (source_wait > wait) {
+      wait = source_wait;
+    }
+  }
+
+  pthread_mutex_lock(&stats_mutex);
+  packets_charged++;
+  if (wait > 0) {
+    packets_throttled++;
+    throttled_seconds += wait;
+    if (wait > max_throttle_seconds) {
+      max_throttle_seconds = wait;
+    }
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  if (wait > 0) {
+    // Not reading from the socket meanwhile pushes back on the sender
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)wait;
+    deadline.tv_nsec += (long)((wait - (time_t)wait) * 1e9);
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&throttle_mutex);
+    while (!throttle_stopping &&
+           pthread_cond_timedwait(&throttle_wake, &throttle_mutex,
+                                  &deadline) != ETIMEDOUT) {
+    }
+    pthread_mutex_unlock(&throttle_mutex);
+  }
+}
+
+void ratelimit_shutdown(void) {
+  pthread_mutex_lock(&throttle_mutex);
+  throttle_stopping = true;
+  pthread_cond_broadcast(&throttle_wake);
+  pthread_mutex_unlock(&throttle_mutex);
+}
+
+void ratelimit_log_stats(void) {
+  pthread_mutex_lock(&sources_mutex);
+  unsigned long sources_tracked = source_count;
+  pthread_mutex_unlock(&sources_mutex);
+
+  pthread_mutex_lock(&stats_mutex);
+  syslog(LOG_INFO,
+         "ratelimit: packets=%lu throttled=%lu throttled_ms=%.0f "
+         "max_throttle_ms=%.0f sources=%lu",
+         packets_charged, packets_throttled, throttled_seconds * 1000,
+         max_throttle_seconds * 1000, sources_tracked);
+  pthread_mutex_unlock(&stats_mutex);
+}
@@ -0,0 +1,72 @@
+#ifndef AESDSOCKET_RATELIMIT_H
+#define AESDSOCKET_RATELIMIT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Token bucket refilled at rate tokens/s up to burst tokens. Tokens may go
+ * negative: the debt is the time the next caller has to wait.
+ */
+struct token_bucket {
+  double rate;   // 0 means unlimited
+  double burst;
+  double tokens;
+  double last;   // time of the last refill in seconds
+};
+
+/**
+ * Packets/s and bytes/s limits for one connection or one source.
+ */
+struct rate_limit {
+  pthread_mutex_t lock;
+  struct token_bucket packets;
+  struct token_bucket bytes;
+};
+
+struct ratelimit_source;
+
+/**
+ * Parse "<packets/s>:<bytes/s>" (0 = unlimited) for every connection
+ * (per_source false) or for all connections of one source IP/uid.
+ * @return 0 on success, -1 if spec is invalid
+ */
+int ratelimit_configure(const char* spec, bool per_source);
+
+/**
+ * Initialise/destroy the per-connection limit with the configured rates.
+ */
+void ratelimit_conn_init(struct rate_limit* limit);
+void ratelimit_conn_destroy(struct rate_limit* limit);
+
+/**
+ * Get the shared limit for a source (IP address, or "uid:N" for AF_UNIX
+ * peers), creating it on first use. Returns NULL when per-source limiting
+ * is disabled. Release with ratelimit_source_put(). A source without
+ * connections keeps its limit until its buckets have refilled, so a client
+ * can't reset it by reconnecting.
+ */
+struct ratelimit_source* ratelimit_source_get(const char* key);
+void ratelimit_source_put(struct ratelimit_source* source);
+
+/**
+ * Charge one packet of the given size to the connection and source
+ * buckets, sleeping while either is in debt. Returns early once
+ * ratelimit_shutdown() has been called.
+ */
+void ratelimit_throttle(struct rate_limit* conn, struct ratelimit_source* source,
+                        size_t bytes);
+
+/**
+ * Wake every throttled connection and stop throttling, so that shutdown
+ * doesn't wait out the sleeps.
+ */
+void ratelimit_shutdown(void);
+
+/**
+ * Log throttle counters to syslog.
+ */
+void ratelimit_log_stats(void);
+
+#endif /* AESDSOCKET_RATELIMIT_H */
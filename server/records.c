@@ -0,0 +1,285 @@
+#include "records.h"
+#include "crc32c.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECORDS_MAGIC "AESDREC1"
+#define RECORDS_MAGIC_SIZE 8
+#define RECORD_HEADER_SIZE 16
+
+// Location of one record's payload in the file
+struct record_index_entry {
+  off_t offset;
+  uint32_t length;
+};
+
+static int records_fd = -1;
+static off_t file_end = 0;          // end of the last valid record
+static uint64_t next_seq = 1;
+static unsigned long long payload_bytes = 0;
+
+// Offset index of all records, in file order
+static struct record_index_entry* record_index = NULL;
+static size_t record_count = 0;
+static size_t index_capacity = 0;
+
+// Startup recovery results
+static off_t recovered_truncated = 0;
+static double scan_ms = 0;
+
+static void put_le32(uint8_t* buf, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    buf[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t get_le32(const uint8_t* buf) {
+  return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 |
+         (uint32_t)buf[3] << 24;
+}
+
+static void put_le64(uint8_t* buf, uint64_t value) {
+  put_le32(buf, (uint32_t)value);
+  put_le32(buf + 4, value >> 32);
+}
+
+static uint64_t get_le64(const uint8_t* buf) {
+  return (uint64_t)get_le32(buf + 4) << 32 | get_le32(buf);
+}
+
+// The CRC covers the length and sequence fields as well as the payload
+static uint32_t record_crc(const uint8_t* header, const void* payload,
+                           size_t len) {
+  uint32_t crc = crc32c(0, header, 4);
+  crc = crc32c(crc, header + 8, 8);
+  return crc32c(crc, payload, len);
+}
+
+static int index_add(off_t offset, uint32_t length) {
+  if (record_count == index_capacity) {
+    size_t capacity = index_capacity ? index_capacity * 2 : 1024;
+    struct record_index_entry* bigger =
+        realloc(record_index, capacity * sizeof(*record_index));
+    if (!bigger) {
+      syslog(LOG_ERR, "Failed to allocate record index: %s", strerror(errno));
+      return -1;
+    }
+    record_index = bigger;
+    index_capacity = capacity;
+  }
+  record_index[record_count].offset = offset;
+  record_index[record_count].length = length;
+  record_count++;
+  payload_bytes += length;
+  return 0;
+}
+
+// Walk the mapped file and index every valid record. Returns the offset
+// where the valid records end, or -1 on failure. *torn_tail tells whether
+// what follows is only a torn last record, which runs to the end of the
+// file, rather than a corrupt record with more data after it.
+static off_t scan_records(const uint8_t* map, off_t size, bool* torn_tail) {
+  off_t pos = RECORDS_MAGIC_SIZE;
+
+  *torn_tail = true;
+  while (size - pos >= RECORD_HEADER_SIZE) {
+    const uint8_t* header = map + pos;
+    uint32_t length = get_le32(header);
+    if ((uint64_t)(size - pos - RECORD_HEADER_SIZE) < length) {
+      break;  // cut short by the end of the file
+    }
+    if (get_le64(header + 8) != next_seq ||
+        record_crc(header, header + RECORD_HEADER_SIZE, length) !=
+            get_le32(header + 4)) {
+      // A torn write is the last thing in the file
+      *torn_tail = (uint64_t)(size - pos - RECORD_HEADER_SIZE) == length;
+      break;
+    }
+    if (index_add(pos + RECORD_HEADER_SIZE, length) < 0) {
+      return -1;
+    }
+    next_seq++;
+    pos += RECORD_HEADER_SIZE + length;
+  }
+  return pos;
+}
+
+bool records_enabled(void) {
+  return records_fd >= 0;
+}
+
+int records_open(const char* path) {
+  struct timespec start, end;
+  struct stat st;
+  off_t valid_end = RECORDS_MAGIC_SIZE;
+  bool torn_tail = true;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    syslog(LOG_ERR, "Failed to open record file %s: %s", path,
+           strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  if (st.st_size >= RECORDS_MAGIC_SIZE) {
+    // The whole file is validated in one pass over a read-only mapping
+    uint8_t* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == map) {
+      syslog(LOG_ERR, "Failed to map record file: %s", strerror(errno));
+      close(fd);
+      return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (memcmp(map, RECORDS_MAGIC, RECORDS_MAGIC_SIZE) != 0) {
+      syslog(LOG_ERR, "%s exists and is not a record file", path);
+      munmap(map, st.st_size);
+      close(fd);
+      return -1;
+    }
+    valid_end = scan_records(map, st.st_size, &torn_tail);
+    munmap(map, st.st_size);
+    if (valid_end < 0) {
+      close(fd);
+      return -1;
+    }
+    if (!torn_tail) {
+      // Truncating would throw away the valid records after the bad one
+      syslog(LOG_ERR,
+             "Record file %s: record %llu at offset %lld is corrupt and "
+             "%lld bytes follow it; refusing to start",
+             path, (unsigned long long)next_seq, (long long)valid_end,
+             (long long)(st.st_size - valid_end));
+      close(fd);
+      records_close();
+      return -1;
+    }
+  } else if (st.st_size > 0) {
+    // Only a torn magic may be overwritten, never someone else's data
+    char head[RECORDS_MAGIC_SIZE];
+    if (pread(fd, head, st.st_size, 0) != st.st_size ||
+        memcmp(head, RECORDS_MAGIC, st.st_size) != 0) {
+      syslog(LOG_ERR, "%s exists and is not a record file", path);
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (st.st_size < RECORDS_MAGIC_SIZE) {
+    // New file, or the magic itself was torn
+    if (ftruncate(fd, 0) < 0 ||
+        write(fd, RECORDS_MAGIC, RECORDS_MAGIC_SIZE) != RECORDS_MAGIC_SIZE) {
+      syslog(LOG_ERR, "Failed to initialise record file: %s", strerror(errno));
+      close(fd);
+      return -1;
+    }
+  } else if (valid_end < st.st_size) {
+    recovered_truncated = st.st_size - valid_end;
+    syslog(LOG_WARNING,
+           "Record file %s: truncating torn tail of %lld bytes after record "
+           "%llu",
+           path, (long long)recovered_truncated,
+           (unsigned long long)(next_seq - 1));
+    if (ftruncate(fd, valid_end) < 0) {
+      syslog(LOG_ERR, "Failed to truncate record file: %s", strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+
+  records_fd = fd;
+  file_end = valid_end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  scan_ms = (end.tv_sec - start.tv_sec) * 1e3 +
+            (end.tv_nsec - start.tv_nsec) / 1e6;
+  syslog(LOG_INFO,
+         "Record file %s: %zu records, %llu bytes, scanned in %.1f ms "
+         "(crc32c %s)",
+         path, record_count, payload_bytes, scan_ms, crc32c_impl());
+  return 0;
+}
+
+void records_close(void) {
+  if (records_fd >= 0) {
+    close(records_fd);
+    records_fd = -1;
+  }
+  free(record_index);
+  record_index = NULL;
+  record_count = index_capacity = 0;
+}
+
+int records_append(const char* data, size_t len) {
+  uint8_t header[RECORD_HEADER_SIZE];
+
+  if (len > UINT32_MAX) {
+    syslog(LOG_ERR, "Record of %zu bytes is too large", len);
+    return -1;
+  }
+  put_le32(header, len);
+  put_le64(header + 8, next_seq);
+  put_le32(header + 4, record_crc(header, data, len));
+
+  // Header and payload go out in one write
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = sizeof(header)},
+      {.iov_base = (void*)data, .iov_len = len},
+  };
+  ssize_t written = writev(records_fd, iov, 2);
+  if (written != (ssize_t)(sizeof(header) + len)) {
+    syslog(LOG_ERR, "Failed to write record: %s",
+           written < 0 ? strerror(errno) : "short write");
+    if (written > 0 && ftruncate(records_fd, file_end) < 0) {
+      syslog(LOG_ERR, "Failed to drop partial record: %s", strerror(errno));
+    }
+    return -1;
+  }
+  if (index_add(file_end + RECORD_HEADER_SIZE, len) < 0) {
+    // Keep the file and index in step
+    if (ftruncate(records_fd, file_end) < 0) {
+      syslog(LOG_ERR, "Failed to drop record: %s", strerror(errno));
+    }
+    return -1;
+  }
+  file_end += written;
+  next_seq++;
+  return 0;
+}
+
+size_t records_strip(char* buf, size_t size) {
+  size_t out = 0;
+
+  for (size_t i = 0; i < record_count; i++) {
+    const struct record_index_entry* entry = &record_index[i];
+    if ((size_t)entry->offset + entry->length > size) {
+      break;
+    }
+    memmove(buf + out, buf + entry->offset, entry->length);
+    out += entry->length;
+  }
+  return out;
+}
+
+void records_log_stats(void) {
+  if (!records_enabled()) {
+    return;
+  }
+  syslog(LOG_INFO,
+         "records: count=%zu payload_bytes=%llu file_bytes=%lld "
+         "recovered_truncated=%lld startup_scan_ms=%.1f crc32c=%s",
+         record_count, payload_bytes, (long long)file_end,
+         (long long)recovered_truncated, scan_ms, crc32c_impl());
+}
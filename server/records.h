@@ -0,0 +1,62 @@
+#ifndef AESDSOCKET_RECORDS_H
+#define AESDSOCKET_RECORDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Optional framed format for the data file (enabled with --records).
+ *
+ * The file starts with the 8 byte magic "AESDREC1", followed by records:
+ *
+ *   bytes 0-3    payload length, little endian
+ *   bytes 4-7    CRC32C over the length, sequence number and payload
+ *   bytes 8-15   sequence number, little endian, consecutive from 1
+ *   payload
+ *
+ * A crash can leave a torn last record behind; records_open() finds the end
+ * of the last valid record, truncates the torn record after it and rebuilds
+ * the in-memory index, so history survives restarts. A corrupt record that
+ * is not the last thing in the file is not truncated: records_open() fails
+ * instead, keeping the records after it. All functions except
+ * records_enabled() must be called from a storage operation (storage.h).
+ */
+
+/**
+ * Whether records_open() has succeeded, i.e. the data file is framed.
+ */
+bool records_enabled(void);
+
+/**
+ * Open (or create) path as a record file, validate it and build the index.
+ * Refuses files that are not record files or hold a corrupt record before
+ * their end.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int records_open(const char* path);
+
+/**
+ * Close the record file; it is kept on disk.
+ */
+void records_close(void);
+
+/**
+ * Append one record with payload data. A failed write is truncated away so
+ * the file never holds a partial record while the server runs.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int records_append(const char* data, size_t len);
+
+/**
+ * Convert size bytes read from the start of the record file in buf into
+ * the concatenated payloads, in place.
+ * @return the number of payload bytes left in buf
+ */
+size_t records_strip(char* buf, size_t size);
+
+/**
+ * Log the record count, payload size and startup recovery to syslog.
+ */
+void records_log_stats(void);
+
+#endif /* AESDSOCKET_RECORDS_H */
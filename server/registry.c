@@ -0,0 +1,177 @@
+#include "registry.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#define SLAB_SLOTS 64
+#define NO_SLOT UINT32_MAX
+
+struct slot {
+  uint32_t generation;
+  uint32_t link;  // next free slot, or position in live[] while used
+  bool used;
+  alignas(max_align_t) char object[];
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registry_empty = PTHREAD_COND_INITIALIZER;
+static size_t slot_size = sizeof(struct slot);
+
+// Slab table: slot i lives in slabs[i / SLAB_SLOTS]
+static char** slabs = NULL;
+static size_t slab_count = 0;
+static size_t slab_capacity = 0;
+static uint32_t free_head = NO_SLOT;
+
+// Dense array of the indices of live slots
+static uint32_t* live = NULL;
+static size_t live_count = 0;
+static size_t live_capacity = 0;
+
+static size_t peak_count = 0;
+static unsigned long total_added = 0;
+
+static struct slot* slot_at(uint32_t index) {
+  return (struct slot*)(slabs[index / SLAB_SLOTS] +
+                        (index % SLAB_SLOTS) * slot_size);
+}
+
+void registry_init(size_t object_size) {
+  size_t align = alignof(struct slot);
+  slot_size = (sizeof(struct slot) + object_size + align - 1) / align * align;
+}
+
+// Add a slab and put its slots on the free list. Called with the lock held.
+static bool grow(void) {
+  if ((slab_count + 1) * SLAB_SLOTS > NO_SLOT) {
+    return false;
+  }
+  if (slab_count == slab_capacity) {
+    size_t capacity = slab_capacity ? slab_capacity * 2 : 16;
+    char** bigger = realloc(slabs, capacity * sizeof(*slabs));
+    if (!bigger) {
+      return false;
+    }
+    slabs = bigger;
+    slab_capacity = capacity;
+  }
+  char* slab = calloc(SLAB_SLOTS, slot_size);
+  if (!slab) {
+    return false;
+  }
+  slabs[slab_count] = slab;
+  // Thread the new slots so the lowest index is handed out first
+  for (int i = SLAB_SLOTS - 1; i >= 0; i--) {
+    uint32_t index = slab_count * SLAB_SLOTS + i;
+    struct slot* slot = (struct slot*)(slab + i * slot_size);
+    slot->link = free_head;
+    free_head = index;
+  }
+  slab_count++;
+  return true;
+}
+
+void* registry_add(uint64_t* id) {
+  void* object = NULL;
+
+  pthread_mutex_lock(&registry_mutex);
+  if (live_count == live_capacity) {
+    size_t capacity = live_capacity ? live_capacity * 2 : SLAB_SLOTS;
+    uint32_t* bigger = realloc(live, capacity * sizeof(*live));
+    if (!bigger) {
+      goto out;
+    }
+    live = bigger;
+    live_capacity = capacity;
+  }
+  if (NO_SLOT == free_head && !grow()) {
+    goto out;
+  }
+
+  uint32_t index = free_head;
+  struct slot* slot = slot_at(index);
+  free_head = slot->link;
+  slot->used = true;
+  slot->link = live_count;
+  live[live_count++] = index;
+  memset(slot->object, 0, slot_size - sizeof(struct slot));
+  *id = (uint64_t)slot->generation << 32 | index;
+  object = slot->object;
+
+  total_added++;
+  if (live_count > peak_count) {
+    peak_count = live_count;
+  }
+out:
+  if (!object) {
+    syslog(LOG_ERR, "Failed to allocate connection slot");
+  }
+  pthread_mutex_unlock(&registry_mutex);
+  return object;
+}
+
+void registry_remove(uint64_t id) {
+  uint32_t index = (uint32_t)id;
+
+  pthread_mutex_lock(&registry_mutex);
+  if (index / SLAB_SLOTS < slab_count) {
+    struct slot* slot = slot_at(index);
+    if (slot->used && slot->generation == (uint32_t)(id >> 32)) {
+      // Move the last live entry into the hole
+      uint32_t moved = live[--live_count];
+      live[slot->link] = moved;
+      slot_at(moved)->link = slot->link;
+
+      slot->used = false;
+      slot->generation++;  // stale ids no longer match
+      slot->link = free_head;
+      free_head = index;
+      if (0 == live_count) {
+        pthread_cond_broadcast(&registry_empty);
+      }
+    }
+  }
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_foreach(void (*fn)(void* object, void* arg), void* arg) {
+  pthread_mutex_lock(&registry_mutex);
+  for (size_t i = 0; i < live_count; i++) {
+    fn(slot_at(live[i])->object, arg);
+  }
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_wait_empty(void) {
+  pthread_mutex_lock(&registry_mutex);
+  while (live_count > 0) {
+    pthread_cond_wait(&registry_empty, &registry_mutex);
+  }
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_destroy(void) {
+  pthread_mutex_lock(&registry_mutex);
+  for (size_t i = 0; i < slab_count; i++) {
+    free(slabs[i]);
+  }
+  free(slabs);
+  free(live);
+  slabs = NULL;
+  live = NULL;
+  slab_count = slab_capacity = live_count = live_capacity = 0;
+  free_head = NO_SLOT;
+  pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_log_stats(void) {
+  pthread_mutex_lock(&registry_mutex);
+  syslog(LOG_INFO,
+         "connections: live=%zu peak=%zu total=%lu slots=%zu",
+         live_count, peak_count, total_added, slab_count * SLAB_SLOTS);
+  pthread_mutex_unlock(&registry_mutex);
+}
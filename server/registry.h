@@ -0,0 +1,52 @@
+#ifndef AESDSOCKET_REGISTRY_H
+#define AESDSOCKET_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Registry of live connections. Objects of a fixed size are carved out of
+ * slabs and addressed by a 64-bit id (slot index plus a generation that
+ * changes on reuse). Add and remove are O(1): free slots are kept on a free
+ * list and live slots in a dense array for iteration. Slab memory is reused,
+ * not returned, until registry_destroy().
+ */
+
+/**
+ * Set the size of the objects handed out by registry_add().
+ */
+void registry_init(size_t object_size);
+
+/**
+ * Allocate a zeroed object and register it.
+ * @return the object (its id in *id) or NULL if out of memory
+ */
+void* registry_add(uint64_t* id);
+
+/**
+ * Unregister and free the object with this id.
+ */
+void registry_remove(uint64_t id);
+
+/**
+ * Call fn for every live object. The registry is locked meanwhile, so
+ * objects cannot be removed under fn; fn must not add or remove.
+ */
+void registry_foreach(void (*fn)(void* object, void* arg), void* arg);
+
+/**
+ * Block until every object has been removed.
+ */
+void registry_wait_empty(void);
+
+/**
+ * Release the slabs. The registry must be empty.
+ */
+void registry_destroy(void);
+
+/**
+ * Log live, peak and total registrations to syslog.
+ */
+void registry_log_stats(void);
+
+#endif /* AESDSOCKET_REGISTRY_H */
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE  // sched_getcpu
+
+#include "storage.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "fair_lock.h"
+
+// Producers on different CPUs push to different queues, so the head they
+// exchange on only bounces between threads sharing a CPU
+#define STORAGE_QUEUES 8
+#define CACHE_LINE 64
+
+// One operation, on the submitter's stack until done is posted
+struct storage_request {
+  _Atomic(struct storage_request*) next;
+  storage_fn fn;  // NULL asks the storage thread to exit
+  void* arg;
+  sem_t done;
+};
+
+// Vyukov's intrusive MPSC queue: producers exchange the head, the storage
+// thread alone walks from the tail. The stub keeps it from running empty.
+struct storage_queue {
+  alignas(CACHE_LINE) _Atomic(struct storage_request*) head;
+  alignas(CACHE_LINE) struct storage_request* tail;
+  struct storage_request stub;
+};
+
+static bool use_thread = false;
+static bool thread_running = false;
+static pthread_t storage_thread;
+static struct storage_queue queues[STORAGE_QUEUES];
+// Set while the storage thread is about to sleep on wakeup
+static atomic_int sleeping = 0;
+static sem_t wakeup;
+
+// Without the storage thread, callers serialise on a FIFO lock
+static struct fair_lock file_lock = FAIR_LOCK_INITIALIZER;
+
+// Statistics; the counters are only written by the thread doing the work
+static atomic_ulong operations = 0;
+static atomic_ulong sleeps = 0;
+static atomic_ulong max_batch = 0;
+
+static void queue_init(struct storage_queue* queue) {
+  atomic_init(&queue->stub.next, NULL);
+  atomic_init(&queue->head, &queue->stub);
+  queue->tail = &queue->stub;
+}
+
+static void queue_push(struct storage_queue* queue,
+                       struct storage_request* request) {
+  atomic_store_explicit(&request->next, NULL, memory_order_relaxed);
+  struct storage_request* prev = atomic_exchange(&queue->head, request);
+  atomic_store_explicit(&prev->next, request, memory_order_release);
+}
+
+// Returns NULL when empty, or while a push is halfway done
+static struct storage_request* queue_pop(struct storage_queue* queue) {
+  struct storage_request* tail = queue->tail;
+  struct storage_request* next =
+      atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (tail == &queue->stub) {
+    if (!next) {
+      return NULL;
+    }
+    queue->tail = tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load(&queue->head)) {
+    return NULL;
+  }
+  // tail is the last request: put the stub behind it so it can be taken
+  queue_push(queue, &queue->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+static bool queue_empty(struct storage_queue* queue) {
+  return queue->tail == &queue->stub &&
+         atomic_load(&queue->head) == &queue->stub;
+}
+
+static void* storage_main(void* arg) {
+  unsigned long batch = 0;
+  bool running = true;
+
+  while (running) {
+    bool progress = false;
+    for (int i = 0; i < STORAGE_QUEUES; i++) {
+      struct storage_request* request;
+      while ((request = queue_pop(&queues[i]))) {
+        progress = true;
+        if (request->fn) {
+          request->fn(request->arg);
+          atomic_fetch_add_explicit(&operations, 1, memory_order_relaxed);
+          batch++;
+        } else {
+          running = false;
+        }
+        sem_post(&request->done);  // request is gone after this
+      }
+    }
+    if (progress) {
+      continue;
+    }
+
+    if (batch > atomic_load_explicit(&max_batch, memory_order_relaxed)) {
+      atomic_store_explicit(&max_batch, batch, memory_order_relaxed);
+    }
+    batch = 0;
+
+    // Announce the sleep, then look once more: a producer either sees the
+    // flag and posts, or pushed early enough to be found here
+    atomic_store(&sleeping, 1);
+    bool empty = true;
+    for (int i = 0; i < STORAGE_QUEUES && empty; i++) {
+      empty = queue_empty(&queues[i]);
+    }
+    if (!empty) {
+      atomic_store(&sleeping, 0);
+      continue;
+    }
+    atomic_fetch_add_explicit(&sleeps, 1, memory_order_relaxed);
+    while (sem_wait(&wakeup) < 0 && EINTR == errno) {
+    }
+  }
+  return NULL;
+}
+
+static void submit(storage_fn fn, void* arg) {
+  struct storage_request request = {.fn = fn, .arg = arg};
+  int cpu = sched_getcpu();
+
+  sem_init(&request.done, 0, 0);
+  queue_push(&queues[(cpu < 0 ? 0 : cpu) % STORAGE_QUEUES], &request);
+  if (atomic_load(&sleeping) && atomic_exchange(&sleeping, 0)) {
+    sem_post(&wakeup);
+  }
+  while (sem_wait(&request.done) < 0 && EINTR == errno) {
+  }
+  sem_destroy(&request.done);
+}
+
+void storage_use_thread(void) { use_thread = true; }
+
+int storage_start(void) {
+  int err;
+
+  if (!use_thread) {
+    return 0;
+  }
+  for (int i = 0; i < STORAGE_QUEUES; i++) {
+    queue_init(&queues[i]);
+  }
+  sem_init(&wakeup, 0, 0);
+  if ((err = pthread_create(&storage_thread, NULL, storage_main, NULL)) != 0) {
+    syslog(LOG_ERR, "Failed to start storage thread: %s", strerror(err));
+    return -1;
+  }
+  thread_running = true;
+  return 0;
+}
+
+void storage_stop(void) {
+  if (thread_running) {
+    submit(NULL, NULL);
+    pthread_join(storage_thread, NULL);
+    sem_destroy(&wakeup);
+    thread_running = false;
+  }
+  fair_lock_destroy(&file_lock);
+}
+
+void storage_run(storage_fn fn, void* arg) {
+  if (thread_running) {
+    submit(fn, arg);
+    return;
+  }
+  fair_lock_acquire(&file_lock);
+  fn(arg);
+  atomic_fetch_add_explicit(&operations, 1, memory_order_relaxed);
+  fair_lock_release(&file_lock);
+}
+
+void storage_log_stats(void) {
+  if (thread_running) {
+    syslog(LOG_INFO, "storage: thread operations=%lu sleeps=%lu max_batch=%lu",
+           atomic_load(&operations), atomic_load(&sleeps),
+           atomic_load(&max_batch));
+  } else {
+    syslog(LOG_INFO, "storage: locked operations=%lu",
+           atomic_load(&operations));
+  }
+}
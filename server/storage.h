@@ -0,0 +1,45 @@
+#ifndef AESDSOCKET_STORAGE_H
+#define AESDSOCKET_STORAGE_H
+
+#include <stdbool.h>
+
+/**
+ * Exclusive access to the data file. By default callers take a FIFO lock
+ * and run their operation on their own thread. With the storage thread
+ * enabled a single thread owns the file instead: callers push operations
+ * onto lock-free queues and wait for the completion, so the file is only
+ * ever touched from one warm core and no lock changes hands per packet.
+ */
+
+typedef void (*storage_fn)(void* arg);
+
+/**
+ * Use a dedicated storage thread (call before storage_start()).
+ */
+void storage_use_thread(void);
+
+/**
+ * Start the storage thread if enabled.
+ * @return 0 on success, -1 on failure (logged)
+ */
+int storage_start(void);
+
+/**
+ * Finish queued operations and stop the storage thread. Callers must no
+ * longer submit operations.
+ */
+void storage_stop(void);
+
+/**
+ * Run fn(arg) with exclusive access to the data file and return once it
+ * has completed. Operations run in submission order per queue; a thread
+ * never has more than one outstanding.
+ */
+void storage_run(storage_fn fn, void* arg);
+
+/**
+ * Log queueing statistics to syslog.
+ */
+void storage_log_stats(void);
+
+#endif /* AESDSOCKET_STORAGE_H */